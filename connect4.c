@@ -3,7 +3,27 @@
 #include <time.h>
 #include <sys/time.h>
 #include <stdint.h>   
+#include <stdarg.h>
+#include <string.h>
 #include <pthread.h>  
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define C4_HAVE_AVX2 1
+#define C4_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define C4_HAVE_AVX2 0
+#endif
 
 #define ROWS 6
 #define COLS 7
@@ -15,12 +35,83 @@
 #define CYAN    "\033[36m"
 #define BOLD    "\033[1m"
 
-char board[ROWS][COLS];
+/* Each thread plays on its own board; workers copy the position they start from. */
+__thread char board[ROWS][COLS];
 
+/* Search state is per thread so a background solver can search while a
+   move is being chosen; the tables are shared. */
 double now_ms();               
-double g_move_start_ms = 0.0;  
-double g_time_limit_ms = 15000.0; 
-int    g_time_over     = 0;    
+__thread double g_move_start_ms = 0.0;  
+__thread double g_time_limit_ms = 15000.0; 
+/* The hard bot's time per move; an async search sets its own. */
+__thread double g_hard_time_limit_ms = 15000.0;
+__thread int    g_time_over     = 0;    
+int    g_stop_requested = 0;
+/* The stop flag this thread's search polls. */
+__thread int   *g_stop_flag = &g_stop_requested;
+/* Optional hard-search limits, 0 for none. */
+__thread unsigned long long g_node_limit = 0;
+__thread int    g_depth_limit = 0;
+/* Search until stopped: the hard search deepens to the last empty cell
+   instead of its usual depth cap. */
+__thread int    g_infinite = 0;
+/* Deterministic hard search: sees only the table entries it stores
+   itself and ignores the clock, so the move depends only on the position
+   and the limits above.  A shared transposition table can hold entries
+   from other processes' deterministic searches and breaks this. */
+__thread int    g_deterministic = 0;
+
+/* Selective search (late move reductions, futility pruning) runs only
+   in iterations too shallow to reach the end of the game; g_selective is
+   set per iteration and its TT entries are kept apart from exact ones.
+   Off unless --selective or the Selective protocol option turns it on:
+   self-play has not shown it to be stronger. */
+int    g_selective_enabled = 0;
+__thread int g_selective = 0;
+
+/* bot_choose_column(BOT_LEVEL_BASE + n) plays strength level n. */
+#define BOT_LEVEL_BASE 10
+__thread char g_first_player  = 0;
+
+__thread unsigned long long g_search_nodes = 0;
+__thread int g_last_search_score = 0;
+__thread int g_last_search_depth = 0;
+
+#define MOVE_SOURCE_SEARCH       0
+#define MOVE_SOURCE_BOOK         1
+#define MOVE_SOURCE_SMALL_BOOK   2
+#define MOVE_SOURCE_FORCED_WIN   3
+#define MOVE_SOURCE_FORCED_BLOCK 4
+#define MOVE_SOURCE_SOLVER       5
+
+/* How the last hard-bot move was chosen and whether its search hit the
+   time limit. */
+__thread int g_last_move_source = MOVE_SOURCE_SEARCH;
+__thread int g_last_search_aborted = 0;
+
+typedef struct {
+    int depth;
+    int score;
+    int best_col;
+    unsigned long long nodes;
+    double elapsed_ms;
+} SearchProgress;
+
+typedef void (*SearchProgressFn)(const SearchProgress *p, void *user);
+
+/* Called after every completed iterative-deepening iteration of this
+   thread's searches. */
+__thread SearchProgressFn g_search_progress_fn = NULL;
+__thread void            *g_search_progress_user = NULL;
+
+void undo_piece(int col);
+int  g_nnue_enabled = 0;
+void nnue_on_place(int r, int c, char token);
+void nnue_on_remove(int r, int c, char token);
+void nnue_refresh();
+__thread int g_eval_inc_active = 0;
+void eval_inc_update(int r, int c, char token, int sign);
+void eval_inc_refresh();
 
 
 void clear_board() {
@@ -30,6 +121,8 @@ void clear_board() {
         while (c < COLS) { board[r][c] = '.'; c++; }
         r++;
     }
+    if (g_nnue_enabled) nnue_refresh();
+    if (g_eval_inc_active) eval_inc_refresh();
 }
 
 const char* color_piece(char p) {
@@ -59,12 +152,24 @@ int is_column_full(int col) {
     return board[ROWS - 1][col] != '.';
 }
 
+int get_next_open_row(int col) {
+    if (col < 0 || col >= COLS) return -1;
+    int r = 0;
+    while (r < ROWS) {
+        if (board[r][col] == '.') return r;
+        r++;
+    }
+    return -1;
+}
+
 int drop_piece(int col, char token) {
     if (col < 0 || col >= COLS) return -1;
     int r = 0;
     while (r < ROWS) {
         if (board[r][col] == '.') {
             board[r][col] = token;
+            if (g_nnue_enabled) nnue_on_place(r, col, token);
+            if (g_eval_inc_active) eval_inc_update(r, col, token, 1);
             return r;
         }
         r++;
@@ -130,17 +235,21 @@ int bot_choose_column_easy() {
     return valid_cols[idx];
 }
 
+/* Would dropping token in col win?  The cell is written directly, so
+   probing skips the incremental evaluation and NNUE updates. */
+int move_wins(int col, char token) {
+    int row = get_next_open_row(col);
+    if (row < 0) return 0;
+    board[row][col] = token;
+    int win = is_winning_move(row, col, token);
+    board[row][col] = '.';
+    return win;
+}
+
 int find_winning_move_for(char token) {
     int col = 0;
     while (col < COLS) {
-        if (!is_column_full(col)) {
-            int row = drop_piece(col, token);
-            if (row != -1) {
-                int win = is_winning_move(row, col, token);
-                board[row][col] = '.';
-                if (win) return col;
-            }
-        }
+        if (move_wins(col, token)) return col;
         col++;
     }
     return -1;
@@ -162,7 +271,7 @@ int bot_choose_column_medium() {
 }
 
 
-#define TT_SIZE 16777259  
+#define TT_DEFAULT_ENTRIES 16777259
 #define TT_INVALID 0
 #define TT_EXACT 1
 #define TT_LOWER 2
@@ -172,12 +281,69 @@ typedef struct {
     unsigned long long hash;
     int score;
     int depth;
-    int flag;
-    int best_move;
+    int8_t best_move;
+    uint8_t flag;
+    uint8_t gen;
 } TTEntry;
 
-TTEntry transposition_table[TT_SIZE];
+/* Deep-tier slot, 16 bytes and written without locks: check holds the
+   key XORed with the packed entry, so a slot torn by a concurrent writer
+   (another thread or another process sharing the table) reads as a miss. */
+typedef struct {
+    uint64_t check;
+    uint64_t data;
+} TTSlot;
+
+/* The deep tier is allocated on first use; tt_resize_mb() changes its
+   size and tt_attach_shared() maps it from shared memory instead. */
+TTSlot *transposition_table = NULL;
+size_t g_tt_entries = TT_DEFAULT_ENTRIES;
 int tt_initialized = 0;
+int g_tt_shared = 0;
+size_t g_tt_shared_bytes = 0;
+
+#define TT_SHM_MAGIC   0x54543443u   /* "C4TT" */
+#define TT_SHM_VERSION 1
+
+/* Shared tables start with this header; the slots follow at header_size. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t slot_size;
+    uint64_t entries;
+    uint32_t ready;
+    uint32_t reserved[9];
+} TTShmHeader;
+
+/* Nodes with little depth left go to a small table that stays in cache,
+   so they neither evict deep results nor miss to DRAM on every probe. */
+#define TT_SMALL_BITS      18
+#define TT_SMALL_SIZE      (1 << TT_SMALL_BITS)
+#define TT_SMALL_MAX_DEPTH 3
+#define TT_TIER_SMALL      0
+#define TT_TIER_LARGE      1
+
+TTEntry tt_small[TT_SMALL_SIZE];
+/* Its entries are not written atomically, so a thread searching
+   alongside the main search points this at a tier of its own. */
+__thread TTEntry *g_tt_small = tt_small;
+
+typedef struct {
+    unsigned long long probes;
+    unsigned long long hits;
+    unsigned long long stores;
+    unsigned long long replacements;
+} TTTierStats;
+
+__thread TTTierStats g_tt_stats[2];
+
+/* Entries are tagged with the generation of the deterministic search
+   that stored them, 0 for every other search.  A deterministic search
+   sees only its own generation, which stands in for clearing both tiers
+   before it starts. */
+unsigned int g_tt_det_generation = 0;
+__thread uint8_t g_tt_generation = 0;
 
 typedef struct {
     unsigned long long botBits;
@@ -185,20 +351,160 @@ typedef struct {
     unsigned long long mask;
 } BitboardState;
 
+void tt_small_clear(TTEntry *tier) {
+    size_t i = 0;
+    while (i < (size_t)TT_SMALL_SIZE) {
+        tier[i].hash = 0;
+        tier[i].score = 0;
+        tier[i].depth = -1;
+        tier[i].flag = TT_INVALID;
+        tier[i].best_move = -1;
+        tier[i].gen = 0;
+        i++;
+    }
+}
+
 void init_transposition_table() {
     if (tt_initialized) return;
-    int i = 0;
-    while (i < TT_SIZE) {
-        transposition_table[i].hash = 0;
-        transposition_table[i].score = 0;
-        transposition_table[i].depth = -1;
-        transposition_table[i].flag = TT_INVALID;
-        transposition_table[i].best_move = -1;
-        i++;
+    if (!transposition_table) {
+        transposition_table = (TTSlot*)calloc(g_tt_entries, sizeof(TTSlot));
+        if (!transposition_table) {
+            fprintf(stderr, "Could not allocate transposition table (%zu entries).\n", g_tt_entries);
+            exit(1);
+        }
+    } else if (!g_tt_shared) {
+        /* A shared table is kept warm for the other processes. */
+        memset(transposition_table, 0, g_tt_entries * sizeof(TTSlot));
     }
+    tt_small_clear(g_tt_small);
     tt_initialized = 1;
 }
 
+/* Generation for the next deterministic search.  Generations are 8 bits,
+   so when they wrap the table is cleared instead, and a generation is
+   never reused while its entries are still stored. */
+uint8_t tt_next_generation() {
+    unsigned int gen = __atomic_add_fetch(&g_tt_det_generation, 1, __ATOMIC_RELAXED) & 0xff;
+    if (gen == 0) {
+        if (!g_tt_shared) {
+            tt_initialized = 0;
+            init_transposition_table();
+        }
+        gen = __atomic_add_fetch(&g_tt_det_generation, 1, __ATOMIC_RELAXED) & 0xff;
+    }
+    return (uint8_t)gen;
+}
+
+static void tt_release() {
+    if (g_tt_shared) {
+        munmap((char*)transposition_table - sizeof(TTShmHeader), g_tt_shared_bytes);
+        g_tt_shared = 0;
+    } else {
+        free(transposition_table);
+    }
+    transposition_table = NULL;
+    tt_initialized = 0;
+}
+
+/* Reallocates the deep tier as a private table of about mb megabytes,
+   clearing both tiers.  Keeps the current table if the allocation fails. */
+int tt_resize_mb(size_t mb) {
+    size_t entries = (mb * 1024 * 1024 / sizeof(TTSlot)) | 1;
+    TTSlot *t = (TTSlot*)calloc(entries, sizeof(TTSlot));
+    if (!t) {
+        fprintf(stderr, "Could not allocate a %zu MB transposition table.\n", mb);
+        return 0;
+    }
+    tt_release();
+    transposition_table = t;
+    g_tt_entries = entries;
+    init_transposition_table();
+    return 1;
+}
+
+/* Maps the deep tier from the POSIX shared-memory object name (e.g.
+   "/c4tt"), creating it with about mb megabytes of slots if it does not
+   exist yet.  Every engine process attached to the same name shares one
+   table.  Refuses objects whose header does not match this layout.  The
+   object outlives the processes; remove it with shm_unlink or by deleting
+   /dev/shm/<name>. */
+int tt_attach_shared(const char *name, size_t mb) {
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Could not open shared transposition table %s.\n", name);
+        return 0;
+    }
+
+    size_t entries = (mb * 1024 * 1024 / sizeof(TTSlot)) | 1;
+    size_t bytes = sizeof(TTShmHeader) + entries * sizeof(TTSlot);
+    if (created) {
+        if (ftruncate(fd, (off_t)bytes) != 0) {
+            fprintf(stderr, "Could not size shared transposition table %s.\n", name);
+            close(fd);
+            shm_unlink(name);
+            return 0;
+        }
+    } else {
+        /* The creator may still be sizing the object. */
+        struct stat st;
+        int tries = 0;
+        while (fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(TTShmHeader) && tries < 100) {
+            usleep(10000);
+            tries++;
+        }
+        if ((size_t)st.st_size < sizeof(TTShmHeader)) {
+            fprintf(stderr, "Shared transposition table %s is not initialised.\n", name);
+            close(fd);
+            return 0;
+        }
+        bytes = (size_t)st.st_size;
+    }
+
+    void *base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Could not map shared transposition table %s.\n", name);
+        return 0;
+    }
+
+    TTShmHeader *h = (TTShmHeader*)base;
+    if (created) {
+        h->magic = TT_SHM_MAGIC;
+        h->version = TT_SHM_VERSION;
+        h->header_size = sizeof(TTShmHeader);
+        h->slot_size = sizeof(TTSlot);
+        h->entries = entries;
+        __atomic_store_n(&h->ready, 1, __ATOMIC_RELEASE);
+    } else {
+        int tries = 0;
+        while (!__atomic_load_n(&h->ready, __ATOMIC_ACQUIRE) && tries < 100) {
+            usleep(10000);
+            tries++;
+        }
+        if (!h->ready || h->magic != TT_SHM_MAGIC || h->version != TT_SHM_VERSION ||
+            h->header_size != sizeof(TTShmHeader) || h->slot_size != sizeof(TTSlot) ||
+            h->entries == 0 || sizeof(TTShmHeader) + h->entries * sizeof(TTSlot) > bytes) {
+            fprintf(stderr, "Shared transposition table %s has an incompatible layout.\n", name);
+            munmap(base, bytes);
+            return 0;
+        }
+        entries = h->entries;
+    }
+
+    tt_release();
+    transposition_table = (TTSlot*)((char*)base + sizeof(TTShmHeader));
+    g_tt_entries = entries;
+    g_tt_shared = 1;
+    g_tt_shared_bytes = bytes;
+    init_transposition_table();
+    return 1;
+}
+
 BitboardState from_board() {
     BitboardState state;
     state.botBits = 0;
@@ -247,52 +553,332 @@ int game_result_for_bot() {
     return 2;
 }
 
+unsigned long long hash_state(const BitboardState *state) {
+    unsigned long long hash = state->botBits;
+    hash ^= state->humanBits * 0x9e3779b9;
+    hash ^= state->mask * 0x517cc1b7;
+    return hash;
+}
+
 unsigned long long hash_board() {
     BitboardState state = from_board();
-    unsigned long long hash = state.botBits;
-    hash ^= state.humanBits * 0x9e3779b9;
-    hash ^= state.mask * 0x517cc1b7;
-    return hash;
+    return hash_state(&state);
 }
 
-int tt_lookup(unsigned long long hash, int depth, int alpha, int beta, int *best_move) {
-    int index = (int)(hash % TT_SIZE);
-    if (index < 0) index += TT_SIZE;
-    TTEntry *entry = &transposition_table[index];
 
-    if (entry->hash == hash && entry->depth >= depth && entry->flag != TT_INVALID) {
-        if (best_move) *best_move = entry->best_move;
-        if (entry->flag == TT_EXACT) return entry->score;
-        if (entry->flag == TT_LOWER && entry->score >= beta) return entry->score;
-        if (entry->flag == TT_UPPER && entry->score <= alpha) return entry->score;
+/* Column-major bitboards with a sentinel bit on top of every column:
+   bit (c * BB_HEIGHT + r) is cell (r, c).  Used by the bulk kernels,
+   where four-in-a-row can be found with shifts instead of scans. */
+#define BB_HEIGHT (ROWS + 1)
+
+static inline uint64_t bb_bottom_mask_col(int c) {
+    return 1ULL << (c * BB_HEIGHT);
+}
+
+static inline uint64_t bb_top_mask_col(int c) {
+    return 1ULL << (ROWS - 1 + c * BB_HEIGHT);
+}
+
+static inline uint64_t bb_column_mask(int c) {
+    return ((1ULL << ROWS) - 1) << (c * BB_HEIGHT);
+}
+
+static inline int bb_has_alignment(uint64_t p) {
+    uint64_t m = p & (p >> BB_HEIGHT);
+    if (m & (m >> (2 * BB_HEIGHT))) return 1;
+    m = p & (p >> (BB_HEIGHT - 1));
+    if (m & (m >> (2 * (BB_HEIGHT - 1)))) return 1;
+    m = p & (p >> (BB_HEIGHT + 1));
+    if (m & (m >> (2 * (BB_HEIGHT + 1)))) return 1;
+    m = p & (p >> 1);
+    if (m & (m >> 2)) return 1;
+    return 0;
+}
+
+int cpu_has_avx2() {
+#if C4_HAVE_AVX2
+    static int cached = -1;
+    if (cached < 0) {
+        __builtin_cpu_init();
+        cached = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return cached;
+#else
+    return 0;
+#endif
+}
+
+void bb_from_board(char token, uint64_t *pos, uint64_t *mask) {
+    uint64_t p = 0, m = 0;
+    int c = 0;
+    while (c < COLS) {
+        int r = 0;
+        while (r < ROWS) {
+            uint64_t bit = 1ULL << (c * BB_HEIGHT + r);
+            if (board[r][c] != '.') {
+                m |= bit;
+                if (board[r][c] == token) p |= bit;
+            }
+            r++;
+        }
+        c++;
+    }
+    *pos = p;
+    *mask = m;
+}
+
+/* bb_from_board() for a row-major BitboardState, visiting only the
+   occupied cells. */
+void bb_from_state(const BitboardState *state, char token, uint64_t *pos, uint64_t *mask) {
+    uint64_t own = (token == 'B') ? state->botBits : state->humanBits;
+    uint64_t rest = state->mask;
+    uint64_t p = 0, m = 0;
+    while (rest) {
+        int i = __builtin_ctzll(rest);
+        uint64_t bit = 1ULL << ((i % COLS) * BB_HEIGHT + i / COLS);
+        m |= bit;
+        if ((own >> i) & 1) p |= bit;
+        rest &= rest - 1;
+    }
+    *pos = p;
+    *mask = m;
+}
+
+static inline uint64_t bb_bottom_row() {
+    uint64_t m = 0;
+    int c = 0;
+    while (c < COLS) { m |= bb_bottom_mask_col(c); c++; }
+    return m;
+}
+
+static inline uint64_t bb_board_mask() {
+    return bb_bottom_row() * ((1ULL << ROWS) - 1);
+}
+
+/* Rows 1, 3, 5 in the numbering print_board() shows (0-based rows 0, 2, 4). */
+static inline uint64_t bb_odd_rows() {
+    return bb_bottom_row() * 0x15ULL;
+}
+
+/* Empty cells that would complete a four for the stones in pos. */
+uint64_t bb_winning_cells(uint64_t pos, uint64_t mask) {
+    uint64_t r = (pos << 1) & (pos << 2) & (pos << 3);
+    int s = BB_HEIGHT - 1;
+    while (s <= BB_HEIGHT + 1) {
+        uint64_t p = (pos << s) & (pos << (2 * s));
+        r |= p & (pos << (3 * s));
+        r |= p & (pos >> s);
+        p = (pos >> s) & (pos >> (2 * s));
+        r |= p & (pos << s);
+        r |= p & (pos >> (3 * s));
+        s++;
+    }
+    return r & (bb_board_mask() ^ mask);
+}
+
+/* The playable cells that do not give the opponent an immediate win:
+   with one threat on a playable cell only that block remains, with two
+   every move loses, and no move may fill the cell under a threat. */
+static inline uint64_t bb_nonlosing_moves(uint64_t playable, uint64_t threats) {
+    uint64_t forced = playable & threats;
+    if (forced) playable = (forced & (forced - 1)) ? 0 : forced;
+    return playable & ~(threats >> 1);
+}
+
+/* Static threat analysis based on row parity.  With every column holding
+   an even number of empty cells the side to move is the first player, and
+   the second player can answer every move in the same column (claimeven),
+   ending up with all empty cells on even rows.  If the first player cannot
+   make a four even when given every empty odd-row cell, the second player
+   never loses; if the second player's share then contains a four, the
+   second player wins. */
+#define THREAT_PROOF_NONE         0
+#define THREAT_PROOF_SECOND_DRAWS 1
+#define THREAT_PROOF_SECOND_WINS  2
+
+typedef struct {
+    uint64_t threats[2];   /* [0] first player, [1] second player */
+    int good[2];           /* threats on the owner's parity: odd rows for the first player, even for the second */
+    int bad[2];            /* threats on the other parity */
+    int proof;
+} ThreatAnalysis;
+
+int claimeven_proof(uint64_t first, uint64_t mask) {
+    uint64_t board_mask = bb_board_mask();
+    uint64_t odd = bb_odd_rows();
+    uint64_t playable = (mask + bb_bottom_row()) & board_mask;
+    if (playable & ~odd) return THREAT_PROOF_NONE;
+
+    uint64_t empty = board_mask & ~mask;
+    if (bb_has_alignment(first | (empty & odd))) return THREAT_PROOF_NONE;
+    uint64_t second = first ^ mask;
+    if (bb_has_alignment(second | (empty & ~odd))) return THREAT_PROOF_SECOND_WINS;
+    return THREAT_PROOF_SECOND_DRAWS;
+}
+
+void analyze_threats(uint64_t first, uint64_t mask, ThreatAnalysis *out) {
+    uint64_t board_mask = bb_board_mask();
+    uint64_t odd = bb_odd_rows();
+    uint64_t playable = (mask + bb_bottom_row()) & board_mask;
+    uint64_t stones[2];
+    stones[0] = first;
+    stones[1] = first ^ mask;
+
+    out->threats[0] = bb_winning_cells(stones[0], mask);
+    out->threats[1] = bb_winning_cells(stones[1], mask);
+
+    int p = 0;
+    while (p < 2) {
+        /* A threat sitting above an opponent threat in the same column
+           never gets played, and playable threats are immediate tactics
+           that the search handles on its own. */
+        uint64_t above = 0, x = out->threats[1 - p];
+        int k = 1;
+        while (k < ROWS) {
+            x = (x << 1) & board_mask;
+            above |= x;
+            k++;
+        }
+        uint64_t useful = out->threats[p] & ~above & ~playable;
+        uint64_t own_parity = (p == 0) ? odd : (board_mask & ~odd);
+        out->good[p] = __builtin_popcountll(useful & own_parity);
+        out->bad[p] = __builtin_popcountll(useful & ~own_parity);
+        p++;
+    }
+
+    out->proof = claimeven_proof(first, mask);
+}
+
+static inline int tt_tier(int depth) {
+    return (depth <= TT_SMALL_MAX_DEPTH) ? TT_TIER_SMALL : TT_TIER_LARGE;
+}
+
+static inline TTEntry* tt_small_entry(unsigned long long hash) {
+    return &g_tt_small[(hash * 0x9e3779b97f4a7c15ULL) >> (64 - TT_SMALL_BITS)];
+}
+
+static inline TTSlot* tt_slot(unsigned long long hash) {
+    return &transposition_table[hash % g_tt_entries];
+}
+
+static inline uint64_t tt_pack(int score, int depth, int flag, int best_move) {
+    return (uint64_t)(uint32_t)score |
+           ((uint64_t)(uint8_t)depth << 32) |
+           ((uint64_t)(uint8_t)flag << 40) |
+           ((uint64_t)(uint8_t)best_move << 48) |
+           ((uint64_t)g_tt_generation << 56);
+}
+
+/* A shallow probe above the horizon may fall back to the deep slot, so
+   both are fetched. */
+static inline void tt_prefetch(unsigned long long hash, int depth) {
+    if (tt_tier(depth) == TT_TIER_SMALL) __builtin_prefetch(tt_small_entry(hash));
+    if (depth > 0) __builtin_prefetch(tt_slot(hash));
+}
+
+/* Copies the tier's slot for hash into out; out->hash is the stored key. */
+static inline void tt_read_tier(unsigned long long hash, int tier, TTEntry *out) {
+    if (tier == TT_TIER_SMALL) {
+        *out = *tt_small_entry(hash);
+    } else {
+        TTSlot *slot = tt_slot(hash);
+        uint64_t data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+        uint64_t check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+        out->hash = check ^ data;
+        out->score = (int32_t)(uint32_t)data;
+        out->depth = (int8_t)(data >> 32);
+        out->flag = (uint8_t)(data >> 40);
+        out->best_move = (int8_t)(data >> 48);
+        out->gen = (uint8_t)(data >> 56);
+    }
+    if (g_tt_generation && out->gen != g_tt_generation) out->flag = TT_INVALID;
+}
+
+/* Copies the entry for (hash, depth) into out.  A shallow probe that
+   misses the small tier falls back to the deep slot, which may hold the
+   same position from a deeper search or the book.  Horizon probes skip
+   the fallback: the static eval it could save is cheaper than the extra
+   memory access. */
+static inline void tt_read(unsigned long long hash, int depth, TTEntry *out) {
+    int tier = tt_tier(depth);
+    tt_read_tier(hash, tier, out);
+    if (tier == TT_TIER_SMALL && depth > 0 &&
+        (out->hash != hash || out->flag == TT_INVALID || out->depth < depth)) {
+        TTEntry deep;
+        tt_read_tier(hash, TT_TIER_LARGE, &deep);
+        if (deep.hash == hash && deep.flag != TT_INVALID && deep.depth >= depth) *out = deep;
+    }
+}
+
+int tt_lookup(unsigned long long hash, int depth, int alpha, int beta, int *best_move) {
+    TTEntry entry;
+    tt_read(hash, depth, &entry);
+    TTTierStats *st = &g_tt_stats[tt_tier(depth)];
+    st->probes++;
+
+    if (entry.hash == hash && entry.depth >= depth && entry.flag != TT_INVALID) {
+        st->hits++;
+        if (best_move) *best_move = entry.best_move;
+        if (entry.flag == TT_EXACT) return entry.score;
+        if (entry.flag == TT_LOWER && entry.score >= beta) return entry.score;
+        if (entry.flag == TT_UPPER && entry.score <= alpha) return entry.score;
     }
     return 99999999; 
 }
 
 void tt_store(unsigned long long hash, int depth, int score, int flag, int best_move) {
-    int index = (int)(hash % TT_SIZE);
-    if (index < 0) index += TT_SIZE;
-    TTEntry *entry = &transposition_table[index];
+    /* Scores backed up from an aborted search are not trustworthy, and
+       the table now outlives a single move. */
+    if (g_time_over) return;
+    int tier = tt_tier(depth);
+    TTEntry entry;
+    tt_read_tier(hash, tier, &entry);
+    int replace;
+
+    if (tier == TT_TIER_SMALL) {
+        /* Shallow results are cheap to recompute: keep the newest, unless
+           it is the same position searched deeper. */
+        replace = entry.flag == TT_INVALID || entry.hash != hash || entry.depth <= depth;
+    } else {
+        /* Deep results are kept unless the newcomer searched at least as
+           deep; an exact score may replace a bound of the same depth. */
+        replace = entry.flag == TT_INVALID ||
+                  (entry.hash != hash && entry.depth <= depth) ||
+                  (entry.hash == hash && entry.depth < depth) ||
+                  (entry.hash == hash && entry.depth == depth && flag == TT_EXACT && entry.flag != TT_EXACT);
+    }
 
-    if (entry->flag == TT_INVALID ||
-        (entry->hash == hash && entry->depth < depth) ||
-        (entry->hash == hash && entry->depth == depth && flag == TT_EXACT && entry->flag != TT_EXACT)) {
-        entry->hash = hash;
-        entry->score = score;
-        entry->depth = depth;
-        entry->flag = flag;
-        entry->best_move = best_move;
+    if (replace) {
+        g_tt_stats[tier].stores++;
+        if (entry.flag != TT_INVALID && entry.hash != hash) g_tt_stats[tier].replacements++;
+        if (tier == TT_TIER_SMALL) {
+            TTEntry *e = tt_small_entry(hash);
+            e->hash = hash;
+            e->score = score;
+            e->depth = depth;
+            e->flag = flag;
+            e->best_move = best_move;
+            e->gen = g_tt_generation;
+        } else {
+            TTSlot *slot = tt_slot(hash);
+            uint64_t data = tt_pack(score, depth, flag, best_move);
+            __atomic_store_n(&slot->check, hash ^ data, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->data, data, __ATOMIC_RELAXED);
+        }
     }
 }
 
-int get_next_open_row(int col) {
-    if (col < 0 || col >= COLS) return -1;
-    int r = 0;
-    while (r < ROWS) {
-        if (board[r][col] == '.') return r;
-        r++;
+void tt_report_stats(FILE *out) {
+    const char *names[2] = {"small", "large"};
+    int t = 0;
+    while (t < 2) {
+        TTTierStats *st = &g_tt_stats[t];
+        fprintf(out, "tt %-5s probes %llu  hits %llu (%.1f%%)  stores %llu  replacements %llu\n",
+                names[t], st->probes, st->hits,
+                st->probes ? 100.0 * st->hits / st->probes : 0.0,
+                st->stores, st->replacements);
+        t++;
     }
-    return -1;
 }
 
 void undo_piece(int col) {
@@ -300,7 +886,10 @@ void undo_piece(int col) {
     int r = ROWS - 1;
     while (r >= 0) {
         if (board[r][col] != '.') {
+            char token = board[r][col];
+            if (g_nnue_enabled) nnue_on_remove(r, col, token);
             board[r][col] = '.';
+            if (g_eval_inc_active) eval_inc_update(r, col, token, -1);
             return;
         }
         r--;
@@ -308,12 +897,218 @@ void undo_piece(int col) {
 }
 
 
-int evaluate_for_bot() {
+/* Handcrafted evaluation.  The window terms (four-cell windows scored
+   by their contents and by whether the cells extending them are empty)
+   and the center bonus are kept up to date by drop_piece and undo_piece
+   once a thread has called eval_inc_refresh; evaluate_for_bot then only
+   adds the fork, combination and parity terms.  evaluate_for_bot_scan
+   computes everything from the board and is kept for checking. */
+#define EVAL_WINDOWS          69
+#define EVAL_CELL_MAX_WINDOWS 24
+
+typedef struct {
+    signed char cells[4][2];
+    signed char ends[2][2];   /* cells extending the window, row -1 if off the board */
+    signed char vertical;
+} EvalWindow;
+
+typedef struct {
+    int score;
+    int bot_threats, human_threats;
+    int bot_open_3, human_open_3;
+} EvalTerms;
+
+EvalWindow g_eval_windows[EVAL_WINDOWS];
+/* Windows touched by each cell, as w * 2 + 1 if the cell is in the window
+   and w * 2 if it only extends it. */
+unsigned char g_eval_cell_windows[ROWS][COLS][EVAL_CELL_MAX_WINDOWS];
+int g_eval_cell_window_count[ROWS][COLS];
+pthread_once_t g_eval_tables_once = PTHREAD_ONCE_INIT;
+
+__thread unsigned char g_eval_counts[EVAL_WINDOWS][2];   /* [0] bot, [1] human */
+__thread EvalTerms g_eval_window_terms[EVAL_WINDOWS];
+__thread EvalTerms g_eval_totals;
+__thread uint64_t g_eval_bot_bits, g_eval_mask_bits;   /* column-major, see bb_from_board */
+
+static void eval_add_window(int n, int r, int c, int dr, int dc, int vertical) {
+    EvalWindow *w = &g_eval_windows[n];
+    int i = 0;
+    while (i < 4) {
+        w->cells[i][0] = r + i * dr;
+        w->cells[i][1] = c + i * dc;
+        int k = g_eval_cell_window_count[r + i * dr][c + i * dc]++;
+        g_eval_cell_windows[r + i * dr][c + i * dc][k] = n * 2 + 1;
+        i++;
+    }
+    w->vertical = vertical;
+    w->ends[0][0] = w->ends[1][0] = -1;
+    if (!vertical) {
+        int ends[2][2] = {{r - dr, c - dc}, {r + 4 * dr, c + 4 * dc}};
+        i = 0;
+        while (i < 2) {
+            int er = ends[i][0], ec = ends[i][1];
+            if (er >= 0 && er < ROWS && ec >= 0 && ec < COLS) {
+                w->ends[i][0] = er;
+                w->ends[i][1] = ec;
+                int k = g_eval_cell_window_count[er][ec]++;
+                g_eval_cell_windows[er][ec][k] = n * 2;
+            }
+            i++;
+        }
+    }
+}
+
+static void eval_init_tables() {
+    int r, c, n = 0;
+    r = 0;
+    while (r < ROWS) {
+        c = 0;
+        while (c <= COLS - 4) { eval_add_window(n++, r, c, 0, 1, 0); c++; }
+        r++;
+    }
+    r = 0;
+    while (r <= ROWS - 4) {
+        c = 0;
+        while (c < COLS) { eval_add_window(n++, r, c, 1, 0, 1); c++; }
+        r++;
+    }
+    r = 0;
+    while (r <= ROWS - 4) {
+        c = 0;
+        while (c <= COLS - 4) { eval_add_window(n++, r, c, 1, 1, 0); c++; }
+        r++;
+    }
+    r = 0;
+    while (r <= ROWS - 4) {
+        c = 3;
+        while (c < COLS) { eval_add_window(n++, r, c, 1, -1, 0); c++; }
+        r++;
+    }
+}
+
+static void eval_window_terms(int w, EvalTerms *t) {
+    const EvalWindow *win = &g_eval_windows[w];
+    int bot_count = g_eval_counts[w][0], human_count = g_eval_counts[w][1];
+    int empty = 4 - bot_count - human_count;
+    memset(t, 0, sizeof(*t));
+
+    if (win->vertical) {
+        if (bot_count == 4) t->score += 100000;
+        else if (bot_count == 3 && empty == 1) { t->score += 600; t->bot_threats++; }
+        else if (bot_count == 2 && empty == 2) t->score += 25;
+
+        if (human_count == 4) t->score -= 100000;
+        else if (human_count == 3 && empty == 1) { t->score -= 1800; t->human_threats++; }
+        else if (human_count == 2 && empty == 2) t->score -= 25;
+        return;
+    }
+
+    int left_open = win->ends[0][0] >= 0 && board[win->ends[0][0]][win->ends[0][1]] == '.';
+    int right_open = win->ends[1][0] >= 0 && board[win->ends[1][0]][win->ends[1][1]] == '.';
+    int both_open = left_open && right_open;
+    int is_open = left_open || right_open;
+
+    if (bot_count == 4) t->score += 100000;
+    else if (bot_count == 3 && empty == 1) {
+        if (both_open) { t->score += 1200; t->bot_open_3++; }
+        else if (is_open) { t->score += 400; t->bot_threats++; }
+        else t->score += 200;
+    }
+    else if (bot_count == 2 && empty == 2) {
+        if (both_open) t->score += 40;
+        else if (is_open) t->score += 20;
+        else t->score += 10;
+    }
+
+    if (human_count == 4) t->score -= 100000;
+    else if (human_count == 3 && empty == 1) {
+        if (both_open) { t->score -= 3000; t->human_open_3++; }
+        else if (is_open) { t->score -= 1500; t->human_threats++; }
+        else t->score -= 300;
+    }
+    else if (human_count == 2 && empty == 2) {
+        if (both_open) t->score -= 40;
+        else if (is_open) t->score -= 20;
+        else t->score -= 10;
+    }
+}
+
+static inline void eval_terms_add(EvalTerms *dst, const EvalTerms *t, int sign) {
+    dst->score += sign * t->score;
+    dst->bot_threats += sign * t->bot_threats;
+    dst->human_threats += sign * t->human_threats;
+    dst->bot_open_3 += sign * t->bot_open_3;
+    dst->human_open_3 += sign * t->human_open_3;
+}
+
+static inline int eval_center_bonus(int c) {
+    if (c == 3) return 20;
+    if (c == 2 || c == 4) return 8;
+    return 0;
+}
+
+/* Rebuilds this thread's window state from the board and keeps it
+   updated from then on. */
+void eval_inc_refresh() {
+    pthread_once(&g_eval_tables_once, eval_init_tables);
+    memset(g_eval_counts, 0, sizeof(g_eval_counts));
+    memset(&g_eval_totals, 0, sizeof(g_eval_totals));
+    bb_from_board('B', &g_eval_bot_bits, &g_eval_mask_bits);
+
+    int w = 0;
+    while (w < EVAL_WINDOWS) {
+        int i = 0;
+        while (i < 4) {
+            char p = board[g_eval_windows[w].cells[i][0]][g_eval_windows[w].cells[i][1]];
+            if (p == 'B') g_eval_counts[w][0]++;
+            else if (p == 'A') g_eval_counts[w][1]++;
+            i++;
+        }
+        eval_window_terms(w, &g_eval_window_terms[w]);
+        eval_terms_add(&g_eval_totals, &g_eval_window_terms[w], 1);
+        w++;
+    }
+
+    int r = 0;
+    while (r < ROWS) {
+        int c = 2;
+        while (c <= 4) {
+            if (board[r][c] == 'B') g_eval_totals.score += eval_center_bonus(c);
+            else if (board[r][c] == 'A') g_eval_totals.score -= eval_center_bonus(c);
+            c++;
+        }
+        r++;
+    }
+    g_eval_inc_active = 1;
+}
+
+/* Called after board[r][c] has been set (sign 1) or cleared (sign -1). */
+void eval_inc_update(int r, int c, char token, int sign) {
+    int side = (token == 'B') ? 0 : 1;
+    uint64_t bit = 1ULL << (c * BB_HEIGHT + r);
+    g_eval_mask_bits ^= bit;
+    if (!side) g_eval_bot_bits ^= bit;
+    g_eval_totals.score += (side ? -sign : sign) * eval_center_bonus(c);
+
+    const unsigned char *list = g_eval_cell_windows[r][c];
+    int n = g_eval_cell_window_count[r][c];
+    int i = 0;
+    while (i < n) {
+        int w = list[i] >> 1;
+        EvalTerms *t = &g_eval_window_terms[w];
+        eval_terms_add(&g_eval_totals, t, -1);
+        if (list[i] & 1) g_eval_counts[w][side] += sign;
+        eval_window_terms(w, t);
+        eval_terms_add(&g_eval_totals, t, 1);
+        i++;
+    }
+}
+
+static void eval_scan_terms(EvalTerms *t) {
     int score = 0;
     int r, c;
     int bot_threats = 0, human_threats = 0;
     int bot_open_3 = 0, human_open_3 = 0;
-    int bot_forks = 0, human_forks = 0;
 
     r = 0;
     while (r < ROWS) {
@@ -331,33 +1126,6 @@ int evaluate_for_bot() {
         r++;
     }
 
-    int bot_win_count = 0, human_win_count = 0;
-    int col = 0;
-    while (col < COLS) {
-        if (!is_column_full(col)) {
-            int row = drop_piece(col, 'B');
-            if (row != -1) {
-                if (is_winning_move(row, col, 'B')) bot_win_count++;
-                undo_piece(col);
-            }
-            row = drop_piece(col, 'A');
-            if (row != -1) {
-                if (is_winning_move(row, col, 'A')) human_win_count++;
-                undo_piece(col);
-            }
-        }
-        col++;
-    }
-
-    if (bot_win_count >= 2) {
-        score += 50000;
-        bot_forks++;
-    }
-    if (human_win_count >= 2) {
-        score -= 50000;
-        human_forks++;
-    }
-
     r = 0;
     while (r < ROWS) {
         c = 0;
@@ -529,17 +1297,471 @@ int evaluate_for_bot() {
         r++;
     }
 
-    if (bot_threats >= 2) score += 2500;
-    if (bot_open_3 >= 2) score += 5000;
+    t->score = score;
+    t->bot_threats = bot_threats;
+    t->human_threats = human_threats;
+    t->bot_open_3 = bot_open_3;
+    t->human_open_3 = human_open_3;
+}
+
+static int eval_finish(const EvalTerms *t, uint64_t bot, uint64_t mask) {
+    int score = t->score;
+    int bot_threats = t->bot_threats, human_threats = t->human_threats;
+    int bot_open_3 = t->bot_open_3, human_open_3 = t->human_open_3;
+    int bot_forks = 0, human_forks = 0;
+
+    /* Columns where a drop wins right away. */
+    uint64_t playable = (mask + bb_bottom_row()) & bb_board_mask();
+    int bot_win_count = __builtin_popcountll(bb_winning_cells(bot, mask) & playable);
+    int human_win_count = __builtin_popcountll(bb_winning_cells(bot ^ mask, mask) & playable);
+
+    if (bot_win_count >= 2) {
+        score += 50000;
+        bot_forks++;
+    }
+    if (human_win_count >= 2) {
+        score -= 50000;
+        human_forks++;
+    }
+
+    if (bot_threats >= 2) score += 2500;
+    if (bot_open_3 >= 2) score += 5000;
     if (bot_forks > 0) score += 10000;
 
     if (human_threats >= 2) score -= 5000;
     if (human_open_3 >= 2) score -= 8000;
     if (human_forks > 0) score -= 20000;
 
+    if (g_first_player) {
+        uint64_t first = (g_first_player == 'B') ? bot : (bot ^ mask);
+        ThreatAnalysis ta;
+        analyze_threats(first, mask, &ta);
+
+        int parity = 900 * ta.good[0] + 150 * ta.bad[0]
+                   - 900 * ta.good[1] - 150 * ta.bad[1];
+        if (ta.good[0] > 0 && ta.good[1] == 0) parity += 4000;
+        if (ta.good[1] > 0 && ta.good[0] == 0) parity -= 4000;
+        if (ta.proof == THREAT_PROOF_SECOND_WINS) parity -= 90000;
+
+        int sign = (g_first_player == 'B') ? 1 : -1;
+        score += sign * parity;
+        if (ta.proof == THREAT_PROOF_SECOND_DRAWS && sign * score > 0) score = 0;
+    }
+
     return score;
 }
 
+int evaluate_for_bot_scan() {
+    EvalTerms t;
+    uint64_t bot, mask;
+    eval_scan_terms(&t);
+    bb_from_board('B', &bot, &mask);
+    return eval_finish(&t, bot, mask);
+}
+
+int evaluate_for_bot() {
+    if (!g_eval_inc_active) return evaluate_for_bot_scan();
+    return eval_finish(&g_eval_totals, g_eval_bot_bits, g_eval_mask_bits);
+}
+
+
+
+
+/* Optional learned evaluation.  One input feature per (player, cell),
+   a single int16 hidden layer kept as an accumulator that drop_piece and
+   undo_piece update incrementally, and a clipped-ReLU output layer.
+
+   Weights file layout (little-endian):
+     char    magic[4] = "C4NN"
+     int32   version, inputs, hidden
+     int16   feature_weights[inputs][hidden]
+     int16   hidden_bias[hidden]
+     int16   output_weights[hidden]
+     int32   output_bias, output_shift
+   Features 0..41 are bot ('B') stones, 42..83 human ('A') stones, cell
+   index r * COLS + c.  The output is from the bot's point of view, in
+   the same units as evaluate_for_bot().  No weights ship with the
+   program: --nnue-train writes c4_nnue.dat, and the network is only used
+   when that file is present. */
+#define NNUE_VERSION 1
+#define NNUE_INPUTS  (2 * ROWS * COLS)
+#define NNUE_HIDDEN  32
+#define NNUE_CLIP    127
+
+typedef struct {
+    int16_t feature_weights[NNUE_INPUTS][NNUE_HIDDEN] __attribute__((aligned(32)));
+    int16_t hidden_bias[NNUE_HIDDEN] __attribute__((aligned(32)));
+    int16_t output_weights[NNUE_HIDDEN] __attribute__((aligned(32)));
+    int32_t output_bias;
+    int32_t output_shift;
+} NnueNetwork;
+
+NnueNetwork g_nnue;
+int         g_nnue_loaded = 0;
+__thread int16_t g_nnue_acc[NNUE_HIDDEN] __attribute__((aligned(32)));
+
+static inline int nnue_feature(int r, int c, char token) {
+    return (token == 'B' ? 0 : ROWS * COLS) + r * COLS + c;
+}
+
+#if C4_HAVE_AVX2
+C4_TARGET_AVX2
+static void nnue_acc_update_avx2(const int16_t *w, int add) {
+    int i = 0;
+    while (i < NNUE_HIDDEN) {
+        __m256i a = _mm256_load_si256((const __m256i*)(g_nnue_acc + i));
+        __m256i d = _mm256_load_si256((const __m256i*)(w + i));
+        a = add ? _mm256_add_epi16(a, d) : _mm256_sub_epi16(a, d);
+        _mm256_store_si256((__m256i*)(g_nnue_acc + i), a);
+        i += 16;
+    }
+}
+
+C4_TARGET_AVX2
+static int32_t nnue_output_avx2() {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i clip = _mm256_set1_epi16(NNUE_CLIP);
+    __m256i sum = zero;
+    int i = 0;
+    while (i < NNUE_HIDDEN) {
+        __m256i a = _mm256_load_si256((const __m256i*)(g_nnue_acc + i));
+        a = _mm256_min_epi16(_mm256_max_epi16(a, zero), clip);
+        __m256i w = _mm256_load_si256((const __m256i*)(g_nnue.output_weights + i));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a, w));
+        i += 16;
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+#endif
+
+static void nnue_acc_update(int feature, int add) {
+    const int16_t *w = g_nnue.feature_weights[feature];
+#if C4_HAVE_AVX2
+    if (cpu_has_avx2()) {
+        nnue_acc_update_avx2(w, add);
+        return;
+    }
+#endif
+    int i = 0;
+    while (i < NNUE_HIDDEN) {
+        g_nnue_acc[i] = (int16_t)(add ? g_nnue_acc[i] + w[i] : g_nnue_acc[i] - w[i]);
+        i++;
+    }
+}
+
+void nnue_on_place(int r, int c, char token) {
+    nnue_acc_update(nnue_feature(r, c, token), 1);
+}
+
+void nnue_on_remove(int r, int c, char token) {
+    nnue_acc_update(nnue_feature(r, c, token), 0);
+}
+
+void nnue_refresh() {
+    memcpy(g_nnue_acc, g_nnue.hidden_bias, sizeof(g_nnue_acc));
+    int r = 0;
+    while (r < ROWS) {
+        int c = 0;
+        while (c < COLS) {
+            if (board[r][c] != '.') nnue_on_place(r, c, board[r][c]);
+            c++;
+        }
+        r++;
+    }
+}
+
+int nnue_evaluate() {
+    int32_t sum;
+#if C4_HAVE_AVX2
+    if (cpu_has_avx2()) {
+        sum = nnue_output_avx2();
+    } else
+#endif
+    {
+        sum = 0;
+        int i = 0;
+        while (i < NNUE_HIDDEN) {
+            int v = g_nnue_acc[i];
+            if (v < 0) v = 0;
+            if (v > NNUE_CLIP) v = NNUE_CLIP;
+            sum += v * g_nnue.output_weights[i];
+            i++;
+        }
+    }
+    return (int)((sum + g_nnue.output_bias) >> g_nnue.output_shift);
+}
+
+int load_nnue_network(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open network file: %s\n", filename);
+        return 0;
+    }
+
+    char magic[4];
+    int32_t header[3];
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "C4NN", 4) != 0 ||
+        fread(header, sizeof(int32_t), 3, f) != 3) {
+        fprintf(stderr, "Network file has invalid header.\n");
+        fclose(f);
+        return 0;
+    }
+    if (header[0] != NNUE_VERSION || header[1] != NNUE_INPUTS || header[2] != NNUE_HIDDEN) {
+        fprintf(stderr, "Network file layout mismatch (version %d, %d x %d).\n",
+                header[0], header[1], header[2]);
+        fclose(f);
+        return 0;
+    }
+
+    size_t ok = 1;
+    ok &= fread(g_nnue.feature_weights, sizeof(int16_t), NNUE_INPUTS * NNUE_HIDDEN, f) == NNUE_INPUTS * NNUE_HIDDEN;
+    ok &= fread(g_nnue.hidden_bias, sizeof(int16_t), NNUE_HIDDEN, f) == NNUE_HIDDEN;
+    ok &= fread(g_nnue.output_weights, sizeof(int16_t), NNUE_HIDDEN, f) == NNUE_HIDDEN;
+    ok &= fread(&g_nnue.output_bias, sizeof(int32_t), 1, f) == 1;
+    ok &= fread(&g_nnue.output_shift, sizeof(int32_t), 1, f) == 1;
+    fclose(f);
+
+    if (!ok || g_nnue.output_shift < 0 || g_nnue.output_shift > 30) {
+        fprintf(stderr, "Failed to read network weights.\n");
+        return 0;
+    }
+
+    g_nnue_loaded = 1;
+    fprintf(stderr, "Loaded evaluation network from %s\n", filename);
+    return 1;
+}
+
+/* Switches leaf evaluation between evaluate_for_bot() and the network.
+   Returns 0 if the network is requested but has not been loaded. */
+int nnue_set_enabled(int enabled) {
+    if (enabled && !g_nnue_loaded) return 0;
+    g_nnue_enabled = enabled;
+    if (enabled) nnue_refresh();
+    return 1;
+}
+
+int evaluate_position() {
+    if (g_nnue_enabled) return nnue_evaluate();
+    return evaluate_for_bot();
+}
+
+
+/* Static-evaluation cache, separate from the TT so leaf scores do not
+   compete with search results for slots.  Each entry stores the key
+   XORed with its data, so a torn write from another thread reads as a
+   miss instead of a wrong score. */
+#define EVAL_CACHE_DEFAULT_BITS 18
+#define EVAL_CACHE_VALID        (1ULL << 32)
+
+typedef struct {
+    uint64_t check;
+    uint64_t data;
+} EvalCacheEntry;
+
+EvalCacheEntry *g_eval_cache = NULL;
+int             g_eval_cache_bits = EVAL_CACHE_DEFAULT_BITS;
+__thread unsigned long long g_eval_cache_probes = 0;
+__thread unsigned long long g_eval_cache_hits = 0;
+
+int init_eval_cache(int bits) {
+    if (g_eval_cache && bits == g_eval_cache_bits) return 1;
+    EvalCacheEntry *cache = (EvalCacheEntry*)calloc((size_t)1 << bits, sizeof(EvalCacheEntry));
+    if (!cache) {
+        fprintf(stderr, "Memory allocation failed for evaluation cache.\n");
+        return 0;
+    }
+    free(g_eval_cache);
+    g_eval_cache = cache;
+    g_eval_cache_bits = bits;
+    return 1;
+}
+
+void clear_eval_cache() {
+    if (g_eval_cache) memset(g_eval_cache, 0, sizeof(EvalCacheEntry) << g_eval_cache_bits);
+}
+
+/* The evaluation depends on the evaluator in use and on who moved first,
+   so both are folded into the key. */
+int evaluate_cached(unsigned long long hash) {
+    if (!g_eval_cache) return evaluate_position();
+
+    uint64_t key = hash ^ ((uint64_t)(unsigned char)g_first_player * 0x9e3779b97f4a7c15ULL)
+                        ^ (g_nnue_enabled ? 0xc2b2ae3d27d4eb4fULL : 0);
+    EvalCacheEntry *e = &g_eval_cache[(key * 0xff51afd7ed558ccdULL) >> (64 - g_eval_cache_bits)];
+    g_eval_cache_probes++;
+
+    uint64_t data = __atomic_load_n(&e->data, __ATOMIC_RELAXED);
+    uint64_t check = __atomic_load_n(&e->check, __ATOMIC_RELAXED);
+    if ((data & EVAL_CACHE_VALID) && (check ^ data) == key) {
+        g_eval_cache_hits++;
+        return (int)(int32_t)(uint32_t)data;
+    }
+
+    int eval = evaluate_position();
+    data = (uint64_t)(uint32_t)eval | EVAL_CACHE_VALID;
+    __atomic_store_n(&e->data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->check, key ^ data, __ATOMIC_RELAXED);
+    return eval;
+}
+
+
+
+
+/* Optional timeline tracing (--trace file).  Spans are recorded into
+   per-thread buffers without locks and written as Chrome trace-event JSON
+   (chrome://tracing, ui.perfetto.dev) by trace_flush() after each move.
+   The file is an unterminated JSON array, which both viewers accept, so
+   moves can keep appending to it.  When tracing is off each TRACE_* site
+   costs one predictable branch. */
+#define TRACE_BUFFER_EVENTS 65536
+
+#define TRACE_BUF_FREE   0
+#define TRACE_BUF_OWNED  1
+#define TRACE_BUF_EXITED 2   /* owner thread gone, events not yet flushed */
+
+typedef struct {
+    const char *name;   /* string literal */
+    double      ts_us;
+    int         arg;
+    char        phase;  /* 'B' or 'E' */
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    int         state;
+    int         tid;
+    int         named;
+    const char *thread_name;
+    int         count;
+    unsigned long long dropped;
+    TraceEvent  events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+int          g_trace_enabled = 0;
+FILE        *g_trace_file = NULL;
+int          g_trace_first_event = 1;
+double       g_trace_start_ms = 0.0;
+TraceBuffer *g_trace_buffers = NULL;   /* push-only list */
+int          g_trace_next_tid = 1;
+pthread_key_t g_trace_key;
+__thread TraceBuffer *g_trace_buf = NULL;
+
+#define TRACE_BEGIN(name, arg) do { if (g_trace_enabled) trace_event((name), 'B', (arg)); } while (0)
+#define TRACE_END(name, arg)   do { if (g_trace_enabled) trace_event((name), 'E', (arg)); } while (0)
+#define TRACE_THREAD(name)     do { if (g_trace_enabled) trace_thread_name(name); } while (0)
+
+static void trace_thread_exit(void *p) {
+    __atomic_store_n(&((TraceBuffer*)p)->state, TRACE_BUF_EXITED, __ATOMIC_RELEASE);
+}
+
+/* Claims a free buffer for this thread, or adds a new one to the list. */
+static TraceBuffer* trace_buffer() {
+    if (g_trace_buf) return g_trace_buf;
+    TraceBuffer *b = __atomic_load_n(&g_trace_buffers, __ATOMIC_ACQUIRE);
+    while (b) {
+        int expected = TRACE_BUF_FREE;
+        if (__atomic_compare_exchange_n(&b->state, &expected, TRACE_BUF_OWNED, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+        b = b->next;
+    }
+    if (!b) {
+        b = (TraceBuffer*)calloc(1, sizeof(TraceBuffer));
+        if (!b) return NULL;
+        b->state = TRACE_BUF_OWNED;
+        b->next = __atomic_load_n(&g_trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&g_trace_buffers, &b->next, b, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    b->tid = __atomic_fetch_add(&g_trace_next_tid, 1, __ATOMIC_RELAXED);
+    b->named = 0;
+    b->thread_name = "thread";
+    pthread_setspecific(g_trace_key, b);
+    g_trace_buf = b;
+    return b;
+}
+
+void trace_thread_name(const char *name) {
+    TraceBuffer *b = trace_buffer();
+    if (b) b->thread_name = name;
+}
+
+void trace_event(const char *name, char phase, int arg) {
+    TraceBuffer *b = trace_buffer();
+    if (!b) return;
+    int n = b->count;
+    if (n >= TRACE_BUFFER_EVENTS) {
+        b->dropped++;
+        return;
+    }
+    TraceEvent *e = &b->events[n];
+    e->name = name;
+    e->phase = phase;
+    e->arg = arg;
+    e->ts_us = (now_ms() - g_trace_start_ms) * 1000.0;
+    __atomic_store_n(&b->count, n + 1, __ATOMIC_RELEASE);
+}
+
+int trace_open(const char *path) {
+    g_trace_file = fopen(path, "w");
+    if (!g_trace_file) {
+        fprintf(stderr, "Could not open trace file: %s\n", path);
+        return 0;
+    }
+    pthread_key_create(&g_trace_key, trace_thread_exit);
+    fprintf(g_trace_file, "[\n");
+    g_trace_first_event = 1;
+    g_trace_start_ms = now_ms();
+    g_trace_enabled = 1;
+    trace_thread_name("main");
+    return 1;
+}
+
+/* Writes and empties every buffer.  Call only while no other traced
+   thread is running, e.g. after a move once its helpers have joined. */
+void trace_flush() {
+    if (!g_trace_file) return;
+    int pid = (int)getpid();
+    TraceBuffer *b = __atomic_load_n(&g_trace_buffers, __ATOMIC_ACQUIRE);
+    while (b) {
+        int state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+        int n = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+        if (state != TRACE_BUF_FREE && !b->named) {
+            fprintf(g_trace_file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    g_trace_first_event ? "" : ",\n", pid, b->tid, b->thread_name);
+            g_trace_first_event = 0;
+            b->named = 1;
+        }
+        int i = 0;
+        while (i < n) {
+            const TraceEvent *e = &b->events[i];
+            fprintf(g_trace_file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.1f,\"pid\":%d,\"tid\":%d,\"args\":{\"v\":%d}}",
+                    g_trace_first_event ? "" : ",\n", e->name, e->phase, e->ts_us, pid, b->tid, e->arg);
+            g_trace_first_event = 0;
+            i++;
+        }
+        if (b->dropped) {
+            fprintf(stderr, "trace: thread %d dropped %llu events\n", b->tid, b->dropped);
+            b->dropped = 0;
+        }
+        __atomic_store_n(&b->count, 0, __ATOMIC_RELEASE);
+        if (state == TRACE_BUF_EXITED) __atomic_store_n(&b->state, TRACE_BUF_FREE, __ATOMIC_RELEASE);
+        b = b->next;
+    }
+    fflush(g_trace_file);
+}
+
+void trace_close() {
+    if (!g_trace_file) return;
+    trace_flush();
+    fprintf(g_trace_file, "\n]\n");
+    fclose(g_trace_file);
+    g_trace_file = NULL;
+    g_trace_enabled = 0;
+}
 
 
 
@@ -563,7 +1785,10 @@ int eval_lightweight(char b[ROWS][COLS]) {
 void* thread_eval_func(void *arg) {
     ThreadEvalTask *task = (ThreadEvalTask*)arg;
 
+    TRACE_THREAD("helper");
+    TRACE_BEGIN("helper_eval", task->thread_id);
     task->partial_score = eval_lightweight(task->board_copy);
+    TRACE_END("helper_eval", task->thread_id);
 
     
     return NULL;
@@ -725,10 +1950,137 @@ typedef struct {
     int32_t  padding;
 } BookEntry;
 
-BookEntry *g_opening_book = NULL;
-int        g_opening_book_size = 0;
+/* outcome is from the point of view of the side to move in the stored
+   position (1 win, 0 draw, -1 loss) and depth is the number of plies to
+   that result, 0 when unknown. */
+
+/* The book is replaced as a whole while searches may be reading it, so
+   readers load g_book once; a replaced table is kept on the retired list
+   until book_reclaim runs with no search going. */
+typedef struct BookTable {
+    BookEntry        *entries;
+    int               size;
+    struct BookTable *retired;
+} BookTable;
+
+BookTable *g_book = NULL;
 int        g_opening_book_loaded = 0;
 
+/* Positions the learner solved, probed after g_book until book_reclaim
+   drops the ones already merged into it.  The learner is the only writer
+   and stores an entry's hash last, so a reader never sees half of one. */
+#define BOOK_LEARNED_BITS 12
+#define BOOK_LEARNED_MAX  (1 << (BOOK_LEARNED_BITS - 1))
+
+BookEntry       g_book_learned[1 << BOOK_LEARNED_BITS];
+int             g_book_learned_n = 0;
+int             g_book_learned_merged = 0;
+pthread_mutex_t g_book_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Only one thread may publish at a time. */
+static void book_publish(BookTable *t) {
+    pthread_mutex_lock(&g_book_lock);
+    t->retired = g_book;
+    __atomic_store_n(&g_book, t, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_opening_book_loaded, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_book_lock);
+}
+
+static void book_free_tables(BookTable *t) {
+    while (t) {
+        BookTable *next = t->retired;
+        free(t->entries);
+        free(t);
+        t = next;
+    }
+}
+
+/* Frees the retired tables and, once all of them are in g_book, the
+   learned entries.  Call only while no search other than the learner's
+   is running; the learner never holds a table it has replaced. */
+void book_reclaim() {
+    pthread_mutex_lock(&g_book_lock);
+    BookTable *retired = NULL;
+    if (g_book) {
+        retired = g_book->retired;
+        g_book->retired = NULL;
+    }
+    if (g_book_learned_n > 0 && g_book_learned_merged == g_book_learned_n) {
+        int i = 0;
+        while (i < (1 << BOOK_LEARNED_BITS)) {
+            __atomic_store_n(&g_book_learned[i].hash, 0, __ATOMIC_RELEASE);
+            i++;
+        }
+        g_book_learned_n = g_book_learned_merged = 0;
+    }
+    pthread_mutex_unlock(&g_book_lock);
+    book_free_tables(retired);
+}
+
+void book_free_all() {
+    book_free_tables(g_book);
+    g_book = NULL;
+    g_opening_book_loaded = 0;
+    memset(g_book_learned, 0, sizeof(g_book_learned));
+    g_book_learned_n = g_book_learned_merged = 0;
+}
+
+static int book_entry_cmp(const void *a, const void *b) {
+    uint64_t ha = ((const BookEntry*)a)->hash;
+    uint64_t hb = ((const BookEntry*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+static const BookEntry* book_table_find(const BookTable *t, uint64_t hash) {
+    if (!t) return NULL;
+    int lo = 0, hi = t->size - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        uint64_t h = t->entries[mid].hash;
+        if (h == hash) return &t->entries[mid];
+        if (h < hash) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+const BookEntry* book_find(uint64_t hash) {
+    const BookEntry *e = book_table_find(__atomic_load_n(&g_book, __ATOMIC_ACQUIRE), hash);
+    if (e) return e;
+    size_t mask = ((size_t)1 << BOOK_LEARNED_BITS) - 1;
+    size_t i = (size_t)hash & mask;
+    uint64_t h;
+    while ((h = __atomic_load_n(&g_book_learned[i].hash, __ATOMIC_ACQUIRE)) != 0) {
+        if (h == hash) return &g_book_learned[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+/* Adds a solved position to the learned entries; returns 0 when they
+   are full.  Learner thread only. */
+static int book_add_learned(const BookEntry *e) {
+    pthread_mutex_lock(&g_book_lock);
+    if (g_book_learned_n >= BOOK_LEARNED_MAX) {
+        pthread_mutex_unlock(&g_book_lock);
+        return 0;
+    }
+    size_t mask = ((size_t)1 << BOOK_LEARNED_BITS) - 1;
+    size_t i = (size_t)e->hash & mask;
+    while (g_book_learned[i].hash) i = (i + 1) & mask;
+    BookEntry *slot = &g_book_learned[i];
+    slot->best_col = e->best_col;
+    slot->outcome = e->outcome;
+    slot->depth = e->depth;
+    slot->reserved = e->reserved;
+    slot->padding = e->padding;
+    __atomic_store_n(&slot->hash, e->hash, __ATOMIC_RELEASE);
+    g_book_learned_n++;
+    __atomic_store_n(&g_opening_book_loaded, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_book_lock);
+    return 1;
+}
+
 
 int load_opening_book(const char *filename) {
     FILE *f = fopen(filename, "rb");
@@ -747,34 +2099,83 @@ int load_opening_book(const char *filename) {
         return 0;
     }
 
-    g_opening_book_size = (int)(filesize / (long)sizeof(BookEntry));
-    g_opening_book = (BookEntry*)malloc(sizeof(BookEntry) * g_opening_book_size);
-    if (!g_opening_book) {
+    BookTable *t = (BookTable*)calloc(1, sizeof(BookTable));
+    if (t) {
+        t->size = (int)(filesize / (long)sizeof(BookEntry));
+        t->entries = (BookEntry*)malloc(sizeof(BookEntry) * t->size);
+    }
+    if (!t || !t->entries) {
         fprintf(stderr, "Memory allocation failed for opening book.\n");
         fclose(f);
-        g_opening_book_size = 0;
+        free(t);
         return 0;
     }
 
-    size_t read_count = fread(g_opening_book, sizeof(BookEntry), g_opening_book_size, f);
+    size_t read_count = fread(t->entries, sizeof(BookEntry), t->size, f);
     fclose(f);
 
-    if ((int)read_count != g_opening_book_size) {
+    if ((int)read_count != t->size) {
         fprintf(stderr, "Failed to read opening book entries.\n");
-        free(g_opening_book);
-        g_opening_book = NULL;
-        g_opening_book_size = 0;
+        free(t->entries);
+        free(t);
         return 0;
     }
 
-    g_opening_book_loaded = 1;
+    qsort(t->entries, (size_t)t->size, sizeof(BookEntry), book_entry_cmp);
+
+    book_publish(t);
     fprintf(stderr, "Loaded opening book: %d entries from %s\n",
-            g_opening_book_size, filename);
+            t->size, filename);
     return 1;
 }
 
 
 
+#define BOOK_VALUE_UNKNOWN (-100000)
+
+/* Maps a book result to a value that prefers quick wins and slow losses. */
+static int book_value(int outcome, int plies) {
+    if (outcome > 0) return 1000 - plies;
+    if (outcome < 0) return -1000 + plies;
+    return 0;
+}
+
+/* Value for the bot after it has just played, looking at the position
+   itself and then at every human reply. */
+static int book_value_after_bot_move() {
+    const BookEntry *e = book_find(hash_board());
+    if (e) return -book_value(e->outcome, e->depth + 1);
+
+    int worst = 1000000;
+    int unknown = 0;
+    int any = 0;
+    int col = 0;
+    while (col < COLS) {
+        if (!is_column_full(col)) {
+            any = 1;
+            int row = drop_piece(col, 'A');
+            if (is_winning_move(row, col, 'A')) {
+                undo_piece(col);
+                return -1000 + 2;
+            }
+            const BookEntry *g = book_find(hash_board());
+            undo_piece(col);
+            if (!g) {
+                unknown = 1;
+            } else {
+                int v = book_value(g->outcome, g->depth + 2);
+                if (v < worst) worst = v;
+            }
+        }
+        col++;
+    }
+    if (!any) return 0;
+    /* A refutation among the known replies settles the child even if
+       some replies are missing from the book. */
+    if (unknown && worst >= 0) return BOOK_VALUE_UNKNOWN;
+    return worst;
+}
+
 int opening_book_move_for_bot_full(int *best_col, int max_book_plies) {
     if (!g_opening_book_loaded) return 0;
 
@@ -797,33 +2198,195 @@ int opening_book_move_for_bot_full(int *best_col, int max_book_plies) {
     uint64_t h = hash_board();
 
     
-    for (int i = 0; i < g_opening_book_size; i++) {
-        if (g_opening_book[i].hash == h) {
-            int col = g_opening_book[i].best_col;
-            if (col >= 0 && col < COLS && !is_column_full(col)) {
+    const BookEntry *e = book_find(h);
+    if (e) {
+        int col = e->best_col;
+        if (col >= 0 && col < COLS && !is_column_full(col)) {
+            if (best_col) *best_col = col;
+            return 1;
+        }
+    }
+
+    /* The position itself is missing: settle the move from the children
+       and grandchildren if their stored results decide it. */
+    int move_order[COLS] = {3, 2, 4, 1, 5, 0, 6};
+    int best_value = -1000000, best_move = -1, unknown = 0;
+    int i = 0;
+    while (i < COLS) {
+        int col = move_order[i];
+        if (!is_column_full(col)) {
+            int row = drop_piece(col, 'B');
+            if (is_winning_move(row, col, 'B')) {
+                undo_piece(col);
                 if (best_col) *best_col = col;
                 return 1;
             }
-            break;
+            int v = book_value_after_bot_move();
+            undo_piece(col);
+            if (v == BOOK_VALUE_UNKNOWN) {
+                unknown = 1;
+            } else if (v > best_value) {
+                best_value = v;
+                best_move = col;
+            }
         }
+        i++;
     }
-    return 0;
+
+    if (best_move < 0) return 0;
+    if (unknown && best_value <= 0) return 0;
+    if (best_col) *best_col = best_move;
+    return 1;
+}
+
+
+
+/* Optional hardware counter instrumentation (--perf).  Counters are opened
+   once per thread through perf_event_open and read before and after each
+   measured phase; when the kernel refuses them only wall time and node
+   counts are reported. */
+#define PERF_COUNTERS 5
+
+int g_perf_enabled = 0;
+
+typedef struct {
+    double             t_start;
+    unsigned long long nodes_start;
+    uint64_t           start[PERF_COUNTERS];
+} PerfSample;
+
+static const char *perf_counter_names[PERF_COUNTERS] = {
+    "cycles", "instructions", "l1d-misses", "llc-misses", "branch-misses"
+};
+
+__thread int g_perf_fds[PERF_COUNTERS];
+__thread int g_perf_opened = 0;
+
+#ifdef __linux__
+static int perf_open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+void perf_open_counters() {
+    if (g_perf_opened) return;
+    g_perf_opened = 1;
+    int available = 0;
+    int i = 0;
+    while (i < PERF_COUNTERS) {
+        g_perf_fds[i] = -1;
+        i++;
+    }
+#ifdef __linux__
+    g_perf_fds[0] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    g_perf_fds[1] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    g_perf_fds[2] = perf_open_counter(PERF_TYPE_HW_CACHE,
+                                      PERF_COUNT_HW_CACHE_L1D |
+                                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    g_perf_fds[3] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    g_perf_fds[4] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+    i = 0;
+    while (i < PERF_COUNTERS) {
+        if (g_perf_fds[i] >= 0) available++;
+        i++;
+    }
+    if (!available) {
+        fprintf(stderr, "perf: hardware counters unavailable, reporting time only\n");
+    }
+}
+
+static uint64_t perf_read_counter(int fd) {
+    uint64_t v = 0;
+    if (fd < 0 || read(fd, &v, sizeof(v)) != (ssize_t)sizeof(v)) return 0;
+    return v;
+}
+
+void perf_begin(PerfSample *s) {
+    if (!g_perf_enabled) return;
+    perf_open_counters();
+    int i = 0;
+    while (i < PERF_COUNTERS) {
+        s->start[i] = perf_read_counter(g_perf_fds[i]);
+        i++;
+    }
+    s->nodes_start = g_search_nodes;
+    s->t_start = now_ms();
+}
+
+void perf_end(PerfSample *s, const char *label, int depth) {
+    if (!g_perf_enabled) return;
+    double ms = now_ms() - s->t_start;
+    unsigned long long nodes = g_search_nodes - s->nodes_start;
+    uint64_t delta[PERF_COUNTERS];
+    int i = 0;
+    while (i < PERF_COUNTERS) {
+        delta[i] = (g_perf_fds[i] >= 0) ? perf_read_counter(g_perf_fds[i]) - s->start[i] : 0;
+        i++;
+    }
+
+    if (depth >= 0) fprintf(stderr, "perf %s %d: %.3f ms  nodes %llu", label, depth, ms, nodes);
+    else fprintf(stderr, "perf %s: %.3f ms  nodes %llu", label, ms, nodes);
+    i = 0;
+    while (i < PERF_COUNTERS) {
+        if (g_perf_fds[i] >= 0) {
+            fprintf(stderr, "  %s %llu", perf_counter_names[i], (unsigned long long)delta[i]);
+            if (nodes > 0) fprintf(stderr, " (%.1f/node)", (double)delta[i] / (double)nodes);
+        }
+        i++;
+    }
+    if (g_perf_fds[0] >= 0 && g_perf_fds[1] >= 0 && delta[0] > 0) {
+        fprintf(stderr, "  ipc %.2f", (double)delta[1] / (double)delta[0]);
+    }
+    fprintf(stderr, "\n");
 }
 
 
 
+#define ETC_MIN_DEPTH 4
+
+__thread unsigned long long g_etc_probes = 0;
+__thread unsigned long long g_etc_cutoffs = 0;
+
+#define BOOK_PROBE_MAX_PIECES 24
+#define BOOK_TT_DEPTH (ROWS * COLS + 1)
+
+#define SELECTIVE_TT_SALT     0x5bd1e9955bd1e995ULL
+#define SELECTIVE_SCORE_BOUND 900000
+#define FUTILITY_MAX_DEPTH    2
+#define LMR_MIN_DEPTH         3
+#define LMR_MIN_MOVE          3
+
+static const int g_futility_margin[FUTILITY_MAX_DEPTH + 1] = {0, 1500, 4000};
+
 int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, int is_root, int max_depth) {
+    g_search_nodes++;
     
-    if (g_time_limit_ms > 0.0) {
+    if (__atomic_load_n(g_stop_flag, __ATOMIC_RELAXED)) {
+        g_time_over = 1;
+    } else if (g_node_limit && g_search_nodes > g_node_limit) {
+        g_time_over = 1;
+    } else if (g_time_limit_ms > 0.0) {
         double now = now_ms();
-        if (now - g_move_start_ms > g_time_limit_ms) {
-            g_time_over = 1;
-            int eval = evaluate_for_bot();
-            return (current_player == 'B') ? eval : -eval;
-        }
+        if (now - g_move_start_ms > g_time_limit_ms) g_time_over = 1;
+    }
+    if (g_time_over) {
+        int eval = evaluate_cached(hash_board());
+        return (current_player == 'B') ? eval : -eval;
     }
 
-    unsigned long long hash = hash_board();
+    BitboardState state = from_board();
+    unsigned long long pos_hash = hash_state(&state);
+    unsigned long long hash = g_selective ? (pos_hash ^ SELECTIVE_TT_SALT) : pos_hash;
+    tt_prefetch(hash, depth);
     char opponent = (current_player == 'B') ? 'A' : 'B';
     int move_order[COLS] = {3, 2, 4, 1, 5, 0, 6};
     (void)max_depth; 
@@ -849,8 +2412,51 @@ int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, i
         return tt_score;
     }
 
+    if (!is_root && g_opening_book_loaded &&
+        __builtin_popcountll(state.mask) <= BOOK_PROBE_MAX_PIECES) {
+        const BookEntry *e = book_find(pos_hash);
+        if (e) {
+            /* Book results are exact, so they are kept in the TT at a
+               depth no search will exceed; later visits cut off in
+               tt_lookup. */
+            int plies = (e->depth > 0 && e->depth < depth) ? e->depth : depth;
+            int book_move = (e->best_col >= 0 && e->best_col < COLS) ? e->best_col : -1;
+            if (e->outcome == 0) {
+                tt_store(hash, BOOK_TT_DEPTH, 0, TT_EXACT, book_move);
+                return 0;
+            }
+            if (e->outcome > 0) {
+                int bound = 1000000 + depth - plies;
+                tt_store(hash, BOOK_TT_DEPTH, bound, TT_LOWER, book_move);
+                if (bound >= beta) return bound;
+                if (bound > alpha) alpha = bound;
+            } else {
+                int bound = -1000000 - depth + plies;
+                tt_store(hash, BOOK_TT_DEPTH, bound, TT_UPPER, book_move);
+                if (bound <= alpha) return bound;
+                if (bound < beta) beta = bound;
+            }
+            if (tt_move < 0) tt_move = book_move;
+        }
+    }
+
+    if (!is_root) {
+        uint64_t cur_bits, mask_bits;
+        bb_from_state(&state, current_player, &cur_bits, &mask_bits);
+        int proof = claimeven_proof(cur_bits, mask_bits);
+        if (proof == THREAT_PROOF_SECOND_WINS) {
+            int score = -1000000 - depth;
+            tt_store(hash, depth, score, TT_EXACT, -1);
+            return score;
+        }
+        if (proof == THREAT_PROOF_SECOND_DRAWS && alpha >= 0) {
+            tt_store(hash, depth, 0, TT_UPPER, -1);
+            return 0;
+        }
+    }
+
     if (depth <= 0) {
-        int eval = evaluate_for_bot();
+        int eval = evaluate_cached(pos_hash);
         int score = (current_player == 'B') ? eval : -eval;
         tt_store(hash, depth, score, TT_EXACT, -1);
         return score;
@@ -860,18 +2466,11 @@ int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, i
     int i = 0;
     while (i < COLS) {
         int col = move_order[i];
-        if (!is_column_full(col)) {
-            int row = drop_piece(col, current_player);
-            if (row != -1) {
-                if (is_winning_move(row, col, current_player)) {
-                    undo_piece(col);
-                    int score = 1000000 + depth;
-                    tt_store(hash, depth, score, TT_EXACT, col);
-                    if (bestCol && is_root) *bestCol = col;
-                    return score;
-                }
-                undo_piece(col);
-            }
+        if (move_wins(col, current_player)) {
+            int score = 1000000 + depth;
+            tt_store(hash, depth, score, TT_EXACT, col);
+            if (bestCol && is_root) *bestCol = col;
+            return score;
         }
         i++;
     }
@@ -881,16 +2480,9 @@ int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, i
     i = 0;
     while (i < COLS) {
         int col = move_order[i];
-        if (!is_column_full(col)) {
-            int row = drop_piece(col, opponent);
-            if (row != -1) {
-                if (is_winning_move(row, col, opponent)) {
-                    undo_piece(col);
-                    opponent_win_col = col;
-                    break;
-                }
-                undo_piece(col);
-            }
+        if (move_wins(col, opponent)) {
+            opponent_win_col = col;
+            break;
         }
         i++;
     }
@@ -908,7 +2500,10 @@ int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, i
                 }
                 int score = -negamax(-beta, -alpha, opponent, depth - 1, NULL, 0, max_depth);
                 undo_piece(opponent_win_col);
-                tt_store(hash, depth, score, TT_EXACT, opponent_win_col);
+                /* The forced reply was searched with the node's window, so
+                   its score is only a bound outside it. */
+                int flag = (score <= alpha) ? TT_UPPER : (score >= beta) ? TT_LOWER : TT_EXACT;
+                tt_store(hash, depth, score, flag, opponent_win_col);
                 if (bestCol && is_root) *bestCol = opponent_win_col;
                 return score;
             }
@@ -918,6 +2513,16 @@ int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, i
         return score;
     }
 
+    /* Futility pruning and razoring: with no immediate tactics left, a
+       static score far outside the window is trusted near the horizon. */
+    if (g_selective && !is_root && depth <= FUTILITY_MAX_DEPTH &&
+        alpha > -SELECTIVE_SCORE_BOUND && beta < SELECTIVE_SCORE_BOUND) {
+        int eval = evaluate_cached(pos_hash);
+        int static_score = (current_player == 'B') ? eval : -eval;
+        if (static_score - g_futility_margin[depth] >= beta) return static_score;
+        if (static_score + g_futility_margin[depth] <= alpha) return static_score;
+    }
+
     int valid_moves[COLS];
     int valid_count = 0;
 
@@ -940,6 +2545,40 @@ int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, i
         return 0;
     }
 
+    /* Enhanced transposition cutoff: if any child is already stored with
+       an upper bound that refutes beta, this node fails high without
+       searching.  Child keys come from the bitboard state and all slots
+       are prefetched before the first probe. */
+    if (depth >= ETC_MIN_DEPTH) {
+        unsigned long long child_hash[COLS];
+        i = 0;
+        while (i < valid_count) {
+            int col = valid_moves[i];
+            unsigned long long bit = 1ULL << (get_next_open_row(col) * COLS + col);
+            BitboardState child = state;
+            if (current_player == 'B') child.botBits |= bit;
+            else child.humanBits |= bit;
+            child.mask |= bit;
+            child_hash[i] = hash_state(&child) ^ (g_selective ? SELECTIVE_TT_SALT : 0);
+            tt_prefetch(child_hash[i], depth - 1);
+            i++;
+        }
+        i = 0;
+        while (i < valid_count) {
+            TTEntry e;
+            tt_read(child_hash[i], depth - 1, &e);
+            g_etc_probes++;
+            if (e.hash == child_hash[i] && e.depth >= depth - 1 &&
+                (e.flag == TT_EXACT || e.flag == TT_UPPER) && -e.score >= beta) {
+                g_etc_cutoffs++;
+                tt_store(hash, depth, -e.score, TT_LOWER, valid_moves[i]);
+                if (bestCol && is_root) *bestCol = valid_moves[i];
+                return -e.score;
+            }
+            i++;
+        }
+    }
+
     int best_score = -2000000;
     int best_move = -1;
     int flag = TT_UPPER;
@@ -952,7 +2591,17 @@ int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, i
             continue;
         }
 
-        int score = -negamax(-beta, -alpha, opponent, depth - 1, NULL, 0, max_depth);
+        int score;
+        /* Late move reduction: moves ordered late get a reduced
+           null-window search first and a full one only if they beat alpha. */
+        if (g_selective && i >= LMR_MIN_MOVE && depth >= LMR_MIN_DEPTH &&
+            alpha > -SELECTIVE_SCORE_BOUND && beta < SELECTIVE_SCORE_BOUND) {
+            int reduction = (depth >= 6 && i >= LMR_MIN_MOVE + 2) ? 2 : 1;
+            score = -negamax(-alpha - 1, -alpha, opponent, depth - 1 - reduction, NULL, 0, max_depth);
+            if (score > alpha) score = -negamax(-beta, -alpha, opponent, depth - 1, NULL, 0, max_depth);
+        } else {
+            score = -negamax(-beta, -alpha, opponent, depth - 1, NULL, 0, max_depth);
+        }
         undo_piece(col);
 
         if (score > best_score) {
@@ -978,23 +2627,413 @@ int negamax(int alpha, int beta, char current_player, int depth, int *bestCol, i
 
 
 
+/* Depth-first proof-number search (df-pn).  A run proves or disproves one
+   goal, "the attacker wins", spending its effort on the moves that are
+   closest to a proof instead of spreading it evenly the way alpha-beta
+   does, which pays off in narrow forcing lines.  A position is solved by
+   up to two runs, one per attacker; when neither side wins it is a draw.
+   Proof and disproof numbers are kept in a table of their own because
+   the alpha-beta TT slots only hold scores.  The table has a fixed size:
+   once it is DFPN_GC_LOAD full, the entries with the least work below
+   them are dropped until it is back to DFPN_GC_TARGET (SmallTreeGC), and
+   a full bucket replaces its cheapest entry.  One solve runs at a time. */
+#define DFPN_TABLE_BITS  20
+#define DFPN_BUCKET      4
+#define DFPN_INF         100000000u
+#define DFPN_GC_LOAD     0.75
+#define DFPN_GC_TARGET   0.5
+
+/* bot_choose_column_hard() hands a position to df-pn once per move when an
+   iteration costs at least DFPN_STALL_NODES without settling it, or when
+   deepening reaches its depth cap unsettled with time left. */
+#define DFPN_MAX_EMPTY   32
+#define DFPN_STALL_NODES 500000ULL
+#define DFPN_MOVE_NODES  4000000ULL
+
+#define DFPN_UNKNOWN 0
+#define DFPN_WIN     1
+#define DFPN_DRAW    2
+#define DFPN_LOSS    3
+
+typedef struct {
+    uint64_t key;    /* 0 for an empty slot */
+    uint32_t pn;
+    uint32_t dn;
+    uint32_t work;   /* nodes searched below this position */
+    uint32_t reserved;
+} DfpnEntry;
+
+typedef struct {
+    DfpnEntry *table;
+    size_t     size;
+    size_t     used;
+    uint64_t   goal;            /* keeps the two runs apart in the table */
+    int        attacker_parity; /* stone count parity when the attacker moves */
+    int        aborted;
+    uint64_t   root_mask;
+    uint64_t   root_move;       /* the root child that settled the last run */
+    uint32_t   root_pn;
+    uint32_t   root_dn;
+    unsigned long long nodes;
+    unsigned long long node_limit;
+    unsigned long long gc_runs;
+} DfpnSearch;
+
+DfpnEntry *g_dfpn_table = NULL;
+
+static inline uint64_t dfpn_key(const DfpnSearch *s, uint64_t cur, uint64_t mask) {
+    return (cur + mask) | s->goal;
+}
+
+static inline DfpnEntry* dfpn_bucket(const DfpnSearch *s, uint64_t key) {
+    size_t b = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> (64 - DFPN_TABLE_BITS)) & ~(size_t)(DFPN_BUCKET - 1);
+    return &s->table[b];
+}
+
+static int dfpn_lookup(const DfpnSearch *s, uint64_t key, uint32_t *pn, uint32_t *dn) {
+    DfpnEntry *e = dfpn_bucket(s, key);
+    int i = 0;
+    while (i < DFPN_BUCKET) {
+        if (e[i].key == key) {
+            *pn = e[i].pn;
+            *dn = e[i].dn;
+            return 1;
+        }
+        i++;
+    }
+    return 0;
+}
+
+static void dfpn_gc(DfpnSearch *s) {
+    uint32_t threshold = 1;
+    s->gc_runs++;
+    while (s->used > (size_t)(s->size * DFPN_GC_TARGET) && threshold) {
+        size_t i = 0;
+        while (i < s->size) {
+            if (s->table[i].key && s->table[i].work < threshold) {
+                s->table[i].key = 0;
+                s->used--;
+            }
+            i++;
+        }
+        threshold *= 2;
+    }
+}
+
+static void dfpn_store(DfpnSearch *s, uint64_t key, uint32_t pn, uint32_t dn, unsigned long long work) {
+    DfpnEntry *e = dfpn_bucket(s, key);
+    DfpnEntry *slot = NULL;
+    int i = 0;
+    while (i < DFPN_BUCKET) {
+        if (e[i].key == key) {
+            slot = &e[i];
+            break;
+        }
+        if (!slot || (slot->key && (!e[i].key || e[i].work < slot->work))) slot = &e[i];
+        i++;
+    }
+    if (!slot->key) s->used++;
+    slot->key = key;
+    slot->pn = pn;
+    slot->dn = dn;
+    slot->work = work > 0xffffffffULL ? 0xffffffffu : (uint32_t)work;
+    if (s->used > (size_t)(s->size * DFPN_GC_LOAD)) dfpn_gc(s);
+}
+
+/* Decides the position without search where possible.  Otherwise returns
+   0 with the moves worth trying and the initial numbers, which favour
+   nodes with few replies. */
+static int dfpn_evaluate(const DfpnSearch *s, uint64_t cur, uint64_t mask,
+                         uint64_t *moves, uint32_t *pn, uint32_t *dn) {
+    int attacker = (__builtin_popcountll(mask) & 1) == s->attacker_parity;
+    uint64_t playable = (mask + bb_bottom_row()) & bb_board_mask();
+    int mover_wins;
+    if (!playable) {
+        *pn = DFPN_INF;
+        *dn = 0;
+        return 1;
+    }
+    if (bb_winning_cells(cur, mask) & playable) {
+        mover_wins = 1;
+    } else {
+        *moves = bb_nonlosing_moves(playable, bb_winning_cells(cur ^ mask, mask));
+        if (*moves) {
+            uint32_t n = (uint32_t)__builtin_popcountll(*moves);
+            *pn = attacker ? 1 : n;
+            *dn = attacker ? n : 1;
+            return 0;
+        }
+        mover_wins = 0;
+    }
+    *pn = (mover_wins == attacker) ? 0 : DFPN_INF;
+    *dn = (mover_wins == attacker) ? DFPN_INF : 0;
+    return 1;
+}
+
+static void dfpn_child(const DfpnSearch *s, uint64_t cur, uint64_t mask, uint64_t move,
+                       uint32_t *pn, uint32_t *dn) {
+    uint64_t ccur = cur ^ mask, cmask = mask | move, moves;
+    if (!dfpn_lookup(s, dfpn_key(s, ccur, cmask), pn, dn)) dfpn_evaluate(s, ccur, cmask, &moves, pn, dn);
+}
+
+static void dfpn_check_limits(DfpnSearch *s) {
+    if (s->node_limit && s->nodes > s->node_limit) s->aborted = 1;
+    else if (__atomic_load_n(g_stop_flag, __ATOMIC_RELAXED)) s->aborted = 1;
+    else if (g_time_limit_ms > 0.0 && now_ms() - g_move_start_ms > g_time_limit_ms) s->aborted = 1;
+}
+
+static void dfpn_mid(DfpnSearch *s, uint64_t cur, uint64_t mask, uint32_t thpn, uint32_t thdn) {
+    unsigned long long start = s->nodes++;
+    if ((s->nodes & 1023) == 0) dfpn_check_limits(s);
+    uint64_t key = dfpn_key(s, cur, mask), moves = 0;
+    uint32_t pn, dn;
+    if (dfpn_evaluate(s, cur, mask, &moves, &pn, &dn)) {
+        dfpn_store(s, key, pn, dn, 0);
+        if (mask == s->root_mask) {
+            s->root_pn = pn;
+            s->root_dn = dn;
+        }
+        return;
+    }
+    int attacker = (__builtin_popcountll(mask) & 1) == s->attacker_parity;
+
+    uint64_t child_moves[COLS];
+    int n = 0;
+    int c = 0;
+    while (c < COLS) {
+        int col = (c & 1) ? 3 - (c + 1) / 2 : 3 + c / 2;   /* centre first */
+        uint64_t move = moves & bb_column_mask(col);
+        if (move) child_moves[n++] = move;
+        c++;
+    }
+
+    int best_i = 0;
+    while (!s->aborted) {
+        /* OR node for the attacker: pn = min, dn = sum; AND node the other way round. */
+        uint64_t sum = 0;
+        uint32_t best = DFPN_INF, second = DFPN_INF, best_other = 0;
+        int i = 0;
+        best_i = 0;
+        while (i < n) {
+            uint32_t cpn, cdn;
+            dfpn_child(s, cur, mask, child_moves[i], &cpn, &cdn);
+            uint32_t v = attacker ? cpn : cdn;
+            uint32_t w = attacker ? cdn : cpn;
+            sum += w;
+            if (v < best) {
+                second = best;
+                best = v;
+                best_i = i;
+                best_other = w;
+            } else if (v < second) {
+                second = v;
+            }
+            i++;
+        }
+        uint32_t total = sum >= DFPN_INF ? DFPN_INF : (uint32_t)sum;
+        pn = attacker ? best : total;
+        dn = attacker ? total : best;
+        if (pn >= thpn || dn >= thdn) break;
+
+        uint32_t th_min = attacker ? thpn : thdn;
+        uint32_t th_sum = attacker ? thdn : thpn;
+        uint32_t child_min = (second < DFPN_INF && second + 1 < th_min) ? second + 1 : th_min;
+        uint64_t child_sum = (uint64_t)th_sum - total + best_other;
+        if (child_sum > DFPN_INF) child_sum = DFPN_INF;
+        dfpn_mid(s, cur ^ mask, mask | child_moves[best_i],
+                 attacker ? child_min : (uint32_t)child_sum,
+                 attacker ? (uint32_t)child_sum : child_min);
+    }
+    if (s->aborted) return;
+    dfpn_store(s, key, pn, dn, s->nodes - start);
+    if (mask == s->root_mask) {
+        s->root_move = child_moves[best_i];
+        s->root_pn = pn;
+        s->root_dn = dn;
+    }
+}
+
+/* One run from the root; returns 1 proved, 0 disproved, -1 aborted. */
+static int dfpn_run(DfpnSearch *s, uint64_t cur, uint64_t mask, int goal) {
+    s->goal = (uint64_t)(goal + 1) << 56;
+    s->attacker_parity = (__builtin_popcountll(mask) + goal) & 1;
+    s->root_mask = mask;
+    s->root_move = 0;
+    s->root_pn = s->root_dn = 1;
+    dfpn_mid(s, cur, mask, DFPN_INF, DFPN_INF);
+    if (s->aborted) return -1;
+    if (s->root_pn == 0) return 1;
+    if (s->root_dn == 0) return 0;
+    return -1;
+}
+
+/* Solves the position with cur to move (column-major bitboards) within
+   node_limit nodes (0 for none) and the current move clock.  Returns
+   DFPN_WIN, DFPN_DRAW, DFPN_LOSS or DFPN_UNKNOWN; best_col gets a move
+   that keeps the result, or for a loss any move.  On a draw, a column
+   already in best_col (-1 for none) is kept if it is proved not to lose. */
+int dfpn_solve(uint64_t cur, uint64_t mask, unsigned long long node_limit,
+               int *best_col, unsigned long long *nodes) {
+    if (!g_dfpn_table) {
+        g_dfpn_table = (DfpnEntry*)malloc(sizeof(DfpnEntry) << DFPN_TABLE_BITS);
+        if (!g_dfpn_table) {
+            fprintf(stderr, "Memory allocation failed for proof-number table.\n");
+            return DFPN_UNKNOWN;
+        }
+    }
+    int prefer = best_col ? *best_col : -1;
+    DfpnSearch s;
+    memset(&s, 0, sizeof(s));
+    s.table = g_dfpn_table;
+    s.size = (size_t)1 << DFPN_TABLE_BITS;
+    s.node_limit = node_limit;
+    memset(s.table, 0, sizeof(DfpnEntry) * s.size);
+
+    /* The root move is the child that settled the run: a proved child of
+       a proved win, a disproved one of a disproved loss. */
+    uint64_t playable = (mask + bb_bottom_row()) & bb_board_mask();
+    uint64_t move = bb_winning_cells(cur, mask) & playable;
+    int result = DFPN_UNKNOWN;
+    int won = move ? 1 : dfpn_run(&s, cur, mask, 0);
+    if (won == 1) {
+        result = DFPN_WIN;
+        if (!move) move = s.root_move;
+    } else if (won == 0) {
+        /* The same table, now with the opponent as the attacker. */
+        int lost = dfpn_run(&s, cur, mask, 1);
+        if (lost == 1) {
+            result = DFPN_LOSS;
+            move = playable & (0ULL - playable);
+        } else if (lost == 0) {
+            result = DFPN_DRAW;
+            move = s.root_move;
+            /* One disproved child settles the run, so the preferred one
+               may still be open; search it with what is left. */
+            uint64_t keep = (prefer >= 0 && prefer < COLS) ? playable & bb_column_mask(prefer) : 0;
+            if (keep && keep != move) {
+                uint32_t pn, dn;
+                dfpn_child(&s, cur, mask, keep, &pn, &dn);
+                if (pn != 0 && dn != 0) {
+                    dfpn_mid(&s, cur ^ mask, mask | keep, DFPN_INF, DFPN_INF);
+                    if (!s.aborted) dfpn_child(&s, cur, mask, keep, &pn, &dn);
+                }
+                if (dn == 0) move = keep;
+            }
+        }
+    }
+    int col = move ? __builtin_ctzll(move) / BB_HEIGHT : -1;
+    if (best_col) *best_col = col;
+    if (nodes) *nodes = s.nodes;
+    return result;
+}
+
+
+
+/* Solves the board, 'B' to move, with exact iterative deepening up to the
+   last empty cell.  Returns 0 if the node limit (0 for none) ran out;
+   otherwise the score and the depth of the iteration that settled it.  A
+   forced result found before the last iteration is exact too, but its
+   ply count may be longer than the shortest win. */
+int alphabeta_solve(unsigned long long node_limit, int *best_col, int *score, int *depth) {
+    uint64_t bits, mask;
+    bb_from_board('B', &bits, &mask);
+    int empty = ROWS * COLS - __builtin_popcountll(mask);
+    if (g_nnue_enabled) nnue_refresh();
+    eval_inc_refresh();
+    g_first_player = (empty % 2 == 0) ? 'B' : 'A';
+    g_move_start_ms = now_ms();
+    g_time_limit_ms = 0.0;
+    g_time_over = 0;
+    g_search_nodes = 0;
+    g_node_limit = node_limit;
+    g_selective = 0;
+
+    int d = (empty < 8) ? empty : 8;
+    int col = -1, s = 0;
+    while (d <= empty) {
+        int best = -1;
+        s = negamax(-2000000, 2000000, 'B', d, &best, 1, empty);
+        if (g_time_over || best < 0) return 0;
+        col = best;
+        if (s >= 1000000 || s <= -1000000) break;
+        d++;
+    }
+    if (d > empty) {
+        if (s != 0) return 0;
+        d = empty;
+    }
+    *best_col = col;
+    *score = s;
+    *depth = d;
+    return 1;
+}
+
+/* Runs df-pn on the board for the hard search.  Returns the move of a
+   proved win or draw, or -1; a proved loss is left to alpha-beta, which
+   resists longest.  On a draw, alpha-beta's best_col stays unless it
+   loses. */
+static int hard_try_dfpn(int depth, int empty_count, int best_col) {
+    uint64_t cur_bits, mask_bits;
+    bb_from_board('B', &cur_bits, &mask_bits);
+    int col = best_col;
+    unsigned long long nodes = 0;
+    TRACE_BEGIN("dfpn", depth);
+    int result = dfpn_solve(cur_bits, mask_bits, DFPN_MOVE_NODES, &col, &nodes);
+    TRACE_END("dfpn", result);
+    g_search_nodes += nodes;
+    if ((result != DFPN_WIN && result != DFPN_DRAW) || col < 0) return -1;
+    g_last_move_source = MOVE_SOURCE_SOLVER;
+    g_last_search_score = (result == DFPN_WIN) ? 1000000 : 0;
+    g_last_search_depth = empty_count;
+    return col;
+}
+
 int bot_choose_column_hard() {
     init_transposition_table();
+    if (!g_eval_cache) init_eval_cache(g_eval_cache_bits);
+    if (g_nnue_enabled) nnue_refresh();
+    eval_inc_refresh();
+    /* The eval cache only memoizes a function of the position, so it
+       does not need clearing for a deterministic search. */
+    g_tt_generation = g_deterministic ? tt_next_generation() : 0;
 
     
     g_move_start_ms = now_ms();
-    g_time_limit_ms = 15000.0; 
+    g_time_limit_ms = g_deterministic ? 0.0 : g_hard_time_limit_ms; 
     g_time_over     = 0;
+    g_search_nodes  = 0;
+    g_last_search_score = 0;
+    g_last_search_depth = 0;
+    g_last_move_source = MOVE_SOURCE_SEARCH;
+    g_last_search_aborted = 0;
+
+    int a_count = 0, b_count = 0;
+    int r0 = 0;
+    while (r0 < ROWS) {
+        int c0 = 0;
+        while (c0 < COLS) {
+            if (board[r0][c0] == 'A') a_count++;
+            else if (board[r0][c0] == 'B') b_count++;
+            c0++;
+        }
+        r0++;
+    }
+    g_first_player = (a_count == b_count) ? 'B' : 'A';
 
     
     
     
+    TRACE_BEGIN("helper_threads", 0);
     run_multithreaded_helper();
+    TRACE_END("helper_threads", 0);
 
     
+    TRACE_BEGIN("book_probe", 0);
     int book_col_full = -1;
     if (opening_book_move_for_bot_full(&book_col_full, 24)) {
         if (!is_column_full(book_col_full)) {
+            g_last_move_source = MOVE_SOURCE_BOOK;
+            TRACE_END("book_probe", book_col_full);
             return book_col_full;
         }
     }
@@ -1002,15 +3041,28 @@ int bot_choose_column_hard() {
     
     int ob_small = opening_book_move_for_bot_small();
     if (ob_small != -1 && !is_column_full(ob_small)) {
+        g_last_move_source = MOVE_SOURCE_SMALL_BOOK;
+        TRACE_END("book_probe", ob_small);
         return ob_small;
     }
+    TRACE_END("book_probe", -1);
 
     
+    TRACE_BEGIN("forced_moves", 0);
     int win_move = find_winning_move_for('B');
-    if (win_move != -1) return win_move;
+    if (win_move != -1) {
+        g_last_move_source = MOVE_SOURCE_FORCED_WIN;
+        TRACE_END("forced_moves", win_move);
+        return win_move;
+    }
 
     int block_move = find_winning_move_for('A');
-    if (block_move != -1) return block_move;
+    if (block_move != -1) {
+        g_last_move_source = MOVE_SOURCE_FORCED_BLOCK;
+        TRACE_END("forced_moves", block_move);
+        return block_move;
+    }
+    TRACE_END("forced_moves", -1);
 
     
     int empty_count = 0;
@@ -1034,29 +3086,63 @@ int bot_choose_column_hard() {
     } else {
         max_depth = 13;
     }
+    if (g_infinite) max_depth = empty_count;
+    if (g_depth_limit > 0 && g_depth_limit < max_depth) {
+        max_depth = g_depth_limit;
+        if (start_depth > max_depth) start_depth = max_depth;
+    }
 
     int best_col = -1;
     int best_score = -2000000;
     int depth = start_depth;
+    /* Node-limited levels stay pure alpha-beta. */
+    int dfpn_tried = (g_node_limit != 0 || empty_count > DFPN_MAX_EMPTY);
 
     
     while (depth <= max_depth) {
         int current_best = -1;
+        PerfSample iteration_perf;
+        perf_begin(&iteration_perf);
+        g_selective = g_selective_enabled && depth < empty_count;
+        unsigned long long iteration_start = g_search_nodes;
+        TRACE_BEGIN("iteration", depth);
         int current_score = negamax(-2000000, 2000000, 'B', depth, &current_best, 1, max_depth);
+        TRACE_END("iteration", depth);
+        perf_end(&iteration_perf, "iteration", depth);
 
         if (g_time_over) {
+            g_last_search_aborted = 1;
             break;
         }
 
         if (current_best >= 0 && current_best < COLS && !is_column_full(current_best)) {
             best_col = current_best;
             best_score = current_score;
+            g_last_search_score = current_score;
+            g_last_search_depth = depth;
+
+            if (g_search_progress_fn) {
+                SearchProgress progress;
+                progress.depth = depth;
+                progress.score = current_score;
+                progress.best_col = current_best;
+                progress.nodes = g_search_nodes;
+                progress.elapsed_ms = now_ms() - g_move_start_ms;
+                g_search_progress_fn(&progress, g_search_progress_user);
+            }
 
             if (current_score >= 1000000 || current_score <= -1000000) {
                 break;
             }
         }
 
+        /* An iteration to the last empty cell is already an exact solve. */
+        if (!dfpn_tried && depth < empty_count && g_search_nodes - iteration_start >= DFPN_STALL_NODES) {
+            dfpn_tried = 1;
+            int solved_col = hard_try_dfpn(depth, empty_count, best_col);
+            if (solved_col >= 0) return solved_col;
+        }
+
         depth++;
 
         if (depth > 12 && (best_score > 800000 || best_score < -800000)) {
@@ -1065,6 +3151,12 @@ int bot_choose_column_hard() {
     }
 
     if (best_col >= 0 && best_col < COLS && !is_column_full(best_col)) {
+        /* Deepening ran out of depth before it ran out of time. */
+        if (!dfpn_tried && !g_time_over && g_last_search_depth < empty_count &&
+            best_score < 1000000 && best_score > -1000000) {
+            int solved_col = hard_try_dfpn(g_last_search_depth, empty_count, best_col);
+            if (solved_col >= 0) return solved_col;
+        }
         return best_col;
     }
 
@@ -1074,6 +3166,7 @@ int bot_choose_column_hard() {
     int best_move_fallback = -1;
     int i = 0;
     int fallback_depth = (max_depth >= 11) ? 11 : max_depth;
+    g_selective = g_selective_enabled && fallback_depth < empty_count;
 
     while (i < COLS) {
         int col2 = move_order[i];
@@ -1093,7 +3186,9 @@ int bot_choose_column_hard() {
             return col2;
         }
 
+        TRACE_BEGIN("fallback", col2);
         int eval = -negamax(-2000000, 2000000, 'A', fallback_depth - 1, NULL, 0, max_depth);
+        TRACE_END("fallback", col2);
         undo_piece(col2);
 
         if (eval > best_score_fallback) {
@@ -1119,102 +3214,3592 @@ int bot_choose_column_hard() {
 
 
 
-int bot_choose_column(int difficulty) {
-    if (difficulty == 1) return bot_choose_column_easy();
-    if (difficulty == 2) return bot_choose_column_medium();
-    if (difficulty == 3) return bot_choose_column_hard();
-    return bot_choose_column_medium();
-}
+/* Move-latency metrics.  Think times go into log-linear (HDR-style)
+   histograms in microseconds, 16 sub-buckets per power of two, split by
+   difficulty and game phase.  With --metrics <path> they are written in
+   Prometheus text format (suitable for the node_exporter textfile
+   collector) by a timer thread every g_metrics_interval_ms, and at exit. */
+#define HIST_SUB_BITS   4
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT  24
+#define HIST_BUCKETS    (HIST_SUB_COUNT + HIST_MAX_SHIFT * HIST_SUB_COUNT)
 
+#define METRICS_DIFFICULTIES 4
+#define METRICS_PHASES       3
 
+typedef struct {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long total;
+    double             sum_us;
+} LatencyHistogram;
 
-double now_ms() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (tv.tv_sec * 1000.0) + (tv.tv_usec / 1000.0);
+typedef struct {
+    LatencyHistogram latency[METRICS_DIFFICULTIES][METRICS_PHASES];
+    unsigned long long book_hits;
+    unsigned long long small_book_hits;
+    unsigned long long forced_wins;
+    unsigned long long forced_blocks;
+    unsigned long long solver_moves;
+    unsigned long long search_aborts;
+} EngineMetrics;
+
+EngineMetrics   g_metrics;
+const char     *g_metrics_path = NULL;
+double          g_metrics_interval_ms = 10000.0;
+/* Guards g_metrics against the export thread. */
+pthread_mutex_t g_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  g_metrics_cond = PTHREAD_COND_INITIALIZER;
+pthread_t       g_metrics_thread;
+int             g_metrics_running = 0;
+int             g_metrics_quit = 0;
+
+static const char *metrics_difficulty_names[METRICS_DIFFICULTIES] = {"easy", "medium", "hard", "level"};
+static const char *metrics_phase_names[METRICS_PHASES] = {"opening", "middlegame", "endgame"};
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    if (shift >= HIST_MAX_SHIFT) return HIST_BUCKETS - 1;
+    return HIST_SUB_COUNT + shift * HIST_SUB_COUNT + (int)((v >> shift) - HIST_SUB_COUNT);
 }
 
+/* Largest value that falls into bucket i. */
+static uint64_t hist_upper(int i) {
+    if (i < HIST_SUB_COUNT) return (uint64_t)i;
+    int shift = (i - HIST_SUB_COUNT) / HIST_SUB_COUNT;
+    uint64_t sub = (uint64_t)((i - HIST_SUB_COUNT) % HIST_SUB_COUNT);
+    return ((HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
 
+void hist_record(LatencyHistogram *h, double us) {
+    uint64_t v = (us < 0.0) ? 0 : (uint64_t)us;
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum_us += us;
+}
 
-int main() {
-    clear_board();
-    srand((unsigned)time(NULL));
+double hist_percentile(const LatencyHistogram *h, double q) {
+    if (h->total == 0) return 0.0;
+    unsigned long long rank = (unsigned long long)(q * (double)h->total + 0.5);
+    if (rank < 1) rank = 1;
+    unsigned long long seen = 0;
+    int i = 0;
+    while (i < HIST_BUCKETS) {
+        seen += h->counts[i];
+        if (seen >= rank) return (double)hist_upper(i);
+        i++;
+    }
+    return (double)hist_upper(HIST_BUCKETS - 1);
+}
 
-    
-    
-    load_opening_book("c4_book_12ply.dat");
+int metrics_phase(int pieces) {
+    if (pieces < 12) return 0;
+    if (pieces < 28) return 1;
+    return 2;
+}
 
-    int mode, difficulty = 2, starter = 1;
-    printf(CYAN BOLD "\nSelect mode:\n" RESET);
-    printf("1. Player vs Player\n");
-    printf("2. Player vs Bot\n> ");
-    scanf("%d", &mode);
+int metrics_export(const char *path) {
+    static const double bounds[] = {
+        0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5,
+        1.0, 2.5, 5.0, 10.0, 15.0, 20.0, 30.0
+    };
+    int n_bounds = (int)(sizeof(bounds) / sizeof(bounds[0]));
+    EngineMetrics m;
+    pthread_mutex_lock(&g_metrics_lock);
+    m = g_metrics;
+    pthread_mutex_unlock(&g_metrics_lock);
+
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        fprintf(stderr, "Could not write metrics file: %s\n", tmp);
+        return 0;
+    }
 
-    if (mode == 2) {
-        printf(CYAN BOLD "\nSelect bot difficulty:\n" RESET);
-        printf("1. Easy\n2. Medium\n3. Hard\n> ");
-        scanf("%d", &difficulty);
+    fprintf(f, "# HELP connect4_move_latency_seconds Bot think time per move.\n");
+    fprintf(f, "# TYPE connect4_move_latency_seconds histogram\n");
+    int d, p, b;
+    for (d = 0; d < METRICS_DIFFICULTIES; d++) {
+        for (p = 0; p < METRICS_PHASES; p++) {
+            const LatencyHistogram *h = &m.latency[d][p];
+            const char *dn = metrics_difficulty_names[d];
+            const char *pn = metrics_phase_names[p];
+            unsigned long long cumulative = 0;
+            int i = 0;
+            for (b = 0; b < n_bounds; b++) {
+                /* Buckets are counted by their upper edge, so a boundary is
+                   exact to within the histogram's ~6% resolution. */
+                double limit_us = bounds[b] * 1e6;
+                while (i < HIST_BUCKETS && (double)hist_upper(i) <= limit_us) {
+                    cumulative += h->counts[i];
+                    i++;
+                }
+                fprintf(f, "connect4_move_latency_seconds_bucket{difficulty=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n",
+                        dn, pn, bounds[b], cumulative);
+            }
+            fprintf(f, "connect4_move_latency_seconds_bucket{difficulty=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n",
+                    dn, pn, h->total);
+            fprintf(f, "connect4_move_latency_seconds_sum{difficulty=\"%s\",phase=\"%s\"} %.6f\n",
+                    dn, pn, h->sum_us / 1e6);
+            fprintf(f, "connect4_move_latency_seconds_count{difficulty=\"%s\",phase=\"%s\"} %llu\n",
+                    dn, pn, h->total);
+        }
+    }
 
-        printf(CYAN BOLD "\nWho starts first?\n" RESET);
-        printf("1. Player (A)\n2. Bot (B)\n> ");
-        scanf("%d", &starter);
+    fprintf(f, "# HELP connect4_move_latency_quantile_seconds Think time quantiles from the HDR histogram.\n");
+    fprintf(f, "# TYPE connect4_move_latency_quantile_seconds gauge\n");
+    for (d = 0; d < METRICS_DIFFICULTIES; d++) {
+        for (p = 0; p < METRICS_PHASES; p++) {
+            const LatencyHistogram *h = &m.latency[d][p];
+            if (h->total == 0) continue;
+            fprintf(f, "connect4_move_latency_quantile_seconds{difficulty=\"%s\",phase=\"%s\",quantile=\"0.5\"} %.6f\n",
+                    metrics_difficulty_names[d], metrics_phase_names[p], hist_percentile(h, 0.5) / 1e6);
+            fprintf(f, "connect4_move_latency_quantile_seconds{difficulty=\"%s\",phase=\"%s\",quantile=\"0.99\"} %.6f\n",
+                    metrics_difficulty_names[d], metrics_phase_names[p], hist_percentile(h, 0.99) / 1e6);
+        }
     }
 
-    char player = (mode == 1 ? 'A' : (starter == 2 ? 'B' : 'A'));
+    fprintf(f, "# HELP connect4_book_hits_total Hard-bot moves answered from an opening book.\n");
+    fprintf(f, "# TYPE connect4_book_hits_total counter\n");
+    fprintf(f, "connect4_book_hits_total{book=\"full\"} %llu\n", m.book_hits);
+    fprintf(f, "connect4_book_hits_total{book=\"small\"} %llu\n", m.small_book_hits);
+    fprintf(f, "# HELP connect4_forced_moves_total Hard-bot moves taken from the immediate win/block shortcuts.\n");
+    fprintf(f, "# TYPE connect4_forced_moves_total counter\n");
+    fprintf(f, "connect4_forced_moves_total{kind=\"win\"} %llu\n", m.forced_wins);
+    fprintf(f, "connect4_forced_moves_total{kind=\"block\"} %llu\n", m.forced_blocks);
+    fprintf(f, "# HELP connect4_solver_moves_total Hard-bot moves proved by the df-pn solver.\n");
+    fprintf(f, "# TYPE connect4_solver_moves_total counter\n");
+    fprintf(f, "connect4_solver_moves_total %llu\n", m.solver_moves);
+    fprintf(f, "# HELP connect4_search_aborts_total Hard-bot searches stopped by the time limit.\n");
+    fprintf(f, "# TYPE connect4_search_aborts_total counter\n");
+    fprintf(f, "connect4_search_aborts_total %llu\n", m.search_aborts);
+
+    int ok = (fclose(f) == 0);
+    if (ok && rename(tmp, path) != 0) ok = 0;
+    if (!ok) fprintf(stderr, "Could not write metrics file: %s\n", path);
+    return ok;
+}
 
-    while (1) {
-        print_board();
+void metrics_record_move(int difficulty, int pieces, double elapsed_ms) {
+    int d = (difficulty >= 1 && difficulty <= 3) ? difficulty - 1 : 1;
+    if (difficulty > BOT_LEVEL_BASE) d = 3;
+    pthread_mutex_lock(&g_metrics_lock);
+    hist_record(&g_metrics.latency[d][metrics_phase(pieces)], elapsed_ms * 1000.0);
+
+    if (difficulty == 3 || difficulty > BOT_LEVEL_BASE) {
+        if (g_last_move_source == MOVE_SOURCE_BOOK) g_metrics.book_hits++;
+        else if (g_last_move_source == MOVE_SOURCE_SMALL_BOOK) g_metrics.small_book_hits++;
+        else if (g_last_move_source == MOVE_SOURCE_FORCED_WIN) g_metrics.forced_wins++;
+        else if (g_last_move_source == MOVE_SOURCE_FORCED_BLOCK) g_metrics.forced_blocks++;
+        else if (g_last_move_source == MOVE_SOURCE_SOLVER) g_metrics.solver_moves++;
+        if (g_last_search_aborted) g_metrics.search_aborts++;
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+}
 
-        if (is_draw()) { printf("DRAW!\n"); break; }
+static void* metrics_thread_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_metrics_lock);
+    while (!g_metrics_quit) {
+        struct timespec until;
+        long ms = (long)g_metrics_interval_ms;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += ms / 1000;
+        until.tv_nsec += (ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&g_metrics_cond, &g_metrics_lock, &until) == 0) continue;
+        if (g_metrics_quit) break;
+        pthread_mutex_unlock(&g_metrics_lock);
+        metrics_export(g_metrics_path);
+        pthread_mutex_lock(&g_metrics_lock);
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+    return NULL;
+}
 
-        if (mode == 2 && player == 'B') {
-            printf(YELLOW BOLD "\nBot is thinking...\n" RESET);
+/* Starts exporting to g_metrics_path every g_metrics_interval_ms; an
+   interval under a millisecond leaves only the export at exit. */
+void metrics_start() {
+    if (!g_metrics_path || g_metrics_interval_ms < 1.0) return;
+    g_metrics_quit = 0;
+    if (pthread_create(&g_metrics_thread, NULL, metrics_thread_main, NULL) != 0) {
+        fprintf(stderr, "Could not start metrics export.\n");
+        return;
+    }
+    g_metrics_running = 1;
+}
 
-            double t1 = now_ms();
-            int col = bot_choose_column(difficulty);
-            double t2 = now_ms();
-            double elapsed = (t2 - t1) / 1000.0;
+/* Stops the export thread and writes the metrics one last time. */
+void metrics_stop() {
+    if (g_metrics_running) {
+        pthread_mutex_lock(&g_metrics_lock);
+        g_metrics_quit = 1;
+        pthread_cond_broadcast(&g_metrics_cond);
+        pthread_mutex_unlock(&g_metrics_lock);
+        pthread_join(g_metrics_thread, NULL);
+        g_metrics_running = 0;
+    }
+    if (g_metrics_path) metrics_export(g_metrics_path);
+}
 
-            printf(RED BOLD "Bot (B) plays column: %d\n" RESET, col + 1);
-            printf(CYAN BOLD "Time taken: %.3f seconds\n\n" RESET, elapsed);
 
-            int r = drop_piece(col, 'B');
-            if (is_winning_move(r, col, 'B')) {
-                print_board();
-                printf(RED BOLD "Bot WINS!\n" RESET);
-                break;
-            }
-        }
-        else {
-            int col;
-            printf(GREEN BOLD "Player %c, choose column (1-7): " RESET, player);
-            scanf("%d", &col);
-            col--;
 
-            int r = drop_piece(col, player);
-            if (r == -1) {
-                printf(RED "Invalid move! Try again.\n" RESET);
-                continue;
-            }
-            if (is_winning_move(r, col, player)) {
-                print_board();
-                printf(GREEN BOLD "Player %c WINS!\n" RESET, player);
-                break;
-            }
-        }
+/* Strength levels: the hard search bounded by a node budget and a depth
+   cap and run deterministically, so each level has a fixed worst-case CPU
+   cost per move and a move can be replayed exactly. */
+typedef struct {
+    unsigned long long nodes;
+    int depth;
+} BotLevel;
+
+static const BotLevel g_bot_levels[] = {
+    {    2000,  4 },
+    {   10000,  6 },
+    {   50000,  8 },
+    {  200000, 10 },
+    { 1000000, 12 },
+    { 5000000, ROWS * COLS },   /* the hard bot's own depth schedule */
+};
+#define BOT_LEVEL_COUNT ((int)(sizeof(g_bot_levels) / sizeof(g_bot_levels[0])))
+
+int bot_choose_column_level(int level) {
+    if (level < 1) level = 1;
+    if (level > BOT_LEVEL_COUNT) level = BOT_LEVEL_COUNT;
+
+    unsigned long long saved_nodes = g_node_limit;
+    int saved_depth = g_depth_limit, saved_det = g_deterministic;
+    g_node_limit = g_bot_levels[level - 1].nodes;
+    g_depth_limit = g_bot_levels[level - 1].depth;
+    g_deterministic = 1;
+
+    int col = bot_choose_column_hard();
+
+    g_tt_generation = 0;
+    g_node_limit = saved_nodes;
+    g_depth_limit = saved_depth;
+    g_deterministic = saved_det;
+    return col;
+}
 
-        if (is_draw()) {
-            print_board();
-            printf("DRAW!\n");
-            break;
+int bot_choose_column(int difficulty) {
+    int pieces = 0;
+    int r = 0;
+    while (r < ROWS) {
+        int c = 0;
+        while (c < COLS) {
+            if (board[r][c] != '.') pieces++;
+            c++;
         }
+        r++;
+    }
 
-        player = (player == 'A') ? 'B' : 'A';
+    double t1 = now_ms();
+    int col;
+    TRACE_BEGIN("move", difficulty);
+    if (difficulty == 1) col = bot_choose_column_easy();
+    else if (difficulty == 2) col = bot_choose_column_medium();
+    else if (difficulty == 3 || difficulty > BOT_LEVEL_BASE) {
+        __atomic_store_n(&g_stop_requested, 0, __ATOMIC_RELAXED);
+        /* The search counts the move's nodes from zero. */
+        g_search_nodes = 0;
+        PerfSample move_perf;
+        perf_begin(&move_perf);
+        if (difficulty == 3) col = bot_choose_column_hard();
+        else col = bot_choose_column_level(difficulty - BOT_LEVEL_BASE);
+        perf_end(&move_perf, "move", -1);
+    }
+    else col = bot_choose_column_medium();
+
+    TRACE_END("move", col);
+    trace_flush();
+
+    metrics_record_move(difficulty, pieces, now_ms() - t1);
+    return col;
+}
+
+
+
+/* Asynchronous hard-bot search.  search_start() copies the caller's board
+   and runs bot_choose_column_hard() on a worker thread; every completed
+   iterative-deepening iteration is reported through the callback (on the
+   worker thread) and kept as the best-so-far result.  search_stop() may
+   be called from any thread; the search then returns the move from its
+   last completed iteration.  The caller's node, depth and determinism
+   limits are copied to the worker; its time limit, callback and stop
+   flag are the worker's own, so searches on other threads keep theirs.
+   Only one search runs at a time. */
+typedef struct {
+    pthread_t        thread;
+    pthread_mutex_t  lock;
+    char             board_copy[ROWS][COLS];
+    double           time_limit_ms;
+    unsigned long long node_limit;
+    int              depth_limit;
+    int              infinite;
+    int              deterministic;
+    SearchProgressFn on_progress;
+    void            *user;
+    SearchProgress   best;
+    int              result_col;
+    int              running;
+    int              stop;
+} AsyncSearch;
+
+int g_async_search_active = 0;
+
+static void async_search_progress(const SearchProgress *p, void *user) {
+    AsyncSearch *s = (AsyncSearch*)user;
+    pthread_mutex_lock(&s->lock);
+    s->best = *p;
+    pthread_mutex_unlock(&s->lock);
+    if (s->on_progress) s->on_progress(p, s->user);
+}
+
+static void* async_search_thread(void *arg) {
+    AsyncSearch *s = (AsyncSearch*)arg;
+    memcpy(board, s->board_copy, sizeof(board));
+    if (g_nnue_enabled) nnue_refresh();
+    g_node_limit = s->node_limit;
+    g_depth_limit = s->depth_limit;
+    g_infinite = s->infinite;
+    g_deterministic = s->deterministic;
+    g_hard_time_limit_ms = s->time_limit_ms;
+    g_search_progress_fn = async_search_progress;
+    g_search_progress_user = s;
+    g_stop_flag = &s->stop;
+    TRACE_THREAD("search");
+    TRACE_BEGIN("async_search", 0);
+
+    int col = bot_choose_column_hard();
+    TRACE_END("async_search", col);
+
+    pthread_mutex_lock(&s->lock);
+    s->result_col = col;
+    if (s->best.depth == 0) s->best.best_col = col;
+    s->running = 0;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/* time_limit_ms <= 0 searches until the depth cap or search_stop(). */
+int search_start(AsyncSearch *s, double time_limit_ms, SearchProgressFn on_progress, void *user) {
+    if (__atomic_exchange_n(&g_async_search_active, 1, __ATOMIC_ACQ_REL)) return 0;
+
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_init(&s->lock, NULL);
+    memcpy(s->board_copy, board, sizeof(board));
+    s->time_limit_ms = time_limit_ms;
+    s->node_limit = g_node_limit;
+    s->depth_limit = g_depth_limit;
+    s->infinite = g_infinite;
+    s->deterministic = g_deterministic;
+    s->on_progress = on_progress;
+    s->user = user;
+    s->best.best_col = -1;
+    s->result_col = -1;
+    s->running = 1;
+
+    if (pthread_create(&s->thread, NULL, async_search_thread, s) != 0) {
+        pthread_mutex_destroy(&s->lock);
+        __atomic_store_n(&g_async_search_active, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    return 1;
+}
+
+void search_stop(AsyncSearch *s) {
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELAXED);
+}
+
+/* Best completed iteration so far; returns 1 while the search runs. */
+int search_poll(AsyncSearch *s, SearchProgress *best) {
+    pthread_mutex_lock(&s->lock);
+    if (best) *best = s->best;
+    int running = s->running;
+    pthread_mutex_unlock(&s->lock);
+    return running;
+}
+
+int search_wait(AsyncSearch *s, SearchProgress *best) {
+    pthread_join(s->thread, NULL);
+    if (best) *best = s->best;
+    int col = s->result_col;
+    pthread_mutex_destroy(&s->lock);
+    __atomic_store_n(&g_async_search_active, 0, __ATOMIC_RELEASE);
+    return col;
+}
+
+
+
+/* Plays the moves (columns 0-6) on a cleared board so that the side to
+   move is 'B', as the hard search expects.  Returns 1 if the game is
+   already over. */
+int setup_position(const int *moves, int n) {
+    clear_board();
+    int over = 0;
+    int i = 0;
+    while (i < n) {
+        char token = ((n - i) % 2 == 0) ? 'B' : 'A';
+        int r = drop_piece(moves[i], token);
+        if (is_winning_move(r, moves[i], token)) over = 1;
+        i++;
     }
+    return over || is_draw();
+}
+
+
+
+void learn_add_line(const int *moves, int n, int prefixes, int lost);
+void learn_pause();
+void learn_resume();
+
+/* Line-based engine protocol (--protocol [--learn] [--trace file]),
+   modelled on UCI so match runners can drive one long-lived process; the
+   TT and book stay loaded across games.  Columns are written 1-7.  The
+   engine always searches for the side to move.
+
+     c4i                            -> id lines, options, c4iok
+     isready                        -> readyok
+     setoption name Hash value <MB>
+     setoption name SharedHash value <shm name, e.g. /c4tt>
+     setoption name Selective value true|false
+     newgame
+     position startpos [moves 4453 | moves 4 4 5 3]
+     go [movetime <ms>] [depth <d>] [nodes <n>] [infinite]
+                                    -> info ... lines, then bestmove <col>|none;
+                                       after go infinite only once stopped
+     stop
+     d                              -> board dump
+     quit
+
+   Scores in info lines are from the side to move's view; |score| >= 1000000
+   is a forced result. */
+#define PROTOCOL_LINE_MAX 4096
+#define PROTOCOL_HASH_MAX_MB 65536
+
+typedef struct {
+    AsyncSearch     search;
+    pthread_t       waiter;
+    int             searching;
+    int             search_done;   /* set by the waiter once bestmove is out */
+    /* An infinite search's bestmove waits for stop, even if it is done. */
+    int             infinite;
+    int             stopped;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int         game_over;
+    int         moves[ROWS * COLS];
+    int         n_moves;
+} ProtocolState;
+
+pthread_mutex_t g_protocol_out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void protocol_send(const char *fmt, ...) {
+    va_list ap;
+    pthread_mutex_lock(&g_protocol_out_lock);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    putchar('\n');
+    fflush(stdout);
+    pthread_mutex_unlock(&g_protocol_out_lock);
+}
+
+static void protocol_progress(const SearchProgress *p, void *user) {
+    (void)user;
+    unsigned long long nps = p->elapsed_ms > 0.0 ? (unsigned long long)(p->nodes * 1000.0 / p->elapsed_ms) : 0;
+    protocol_send("info depth %d score %d nodes %llu time %.0f nps %llu pv %d",
+                  p->depth, p->score, p->nodes, p->elapsed_ms, nps, p->best_col + 1);
+}
 
-    if (g_opening_book) {
-        free(g_opening_book);
+static void* protocol_waiter(void *arg) {
+    ProtocolState *ps = (ProtocolState*)arg;
+    SearchProgress best;
+    int col = search_wait(&ps->search, &best);
+    if (ps->infinite) {
+        pthread_mutex_lock(&ps->lock);
+        while (!ps->stopped) pthread_cond_wait(&ps->cond, &ps->lock);
+        pthread_mutex_unlock(&ps->lock);
     }
+    if (col >= 0) protocol_send("bestmove %d", col + 1);
+    else protocol_send("bestmove none");
+    __atomic_store_n(&ps->search_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Stops a running search and waits until its bestmove has been sent. */
+static void protocol_finish_search(ProtocolState *ps) {
+    if (!ps->searching) return;
+    pthread_mutex_lock(&ps->lock);
+    ps->stopped = 1;
+    pthread_cond_broadcast(&ps->cond);
+    pthread_mutex_unlock(&ps->lock);
+    search_stop(&ps->search);
+    pthread_join(ps->waiter, NULL);
+    ps->searching = 0;
+    book_reclaim();
+    /* The search thread has exited, so its trace buffer can be written. */
+    trace_flush();
+}
+
+/* Plays the recorded moves so that the side to move ends up as 'B'. */
+static void protocol_setup_board(ProtocolState *ps) {
+    ps->game_over = setup_position(ps->moves, ps->n_moves);
+}
+
+static int protocol_parse_position(ProtocolState *ps, char *args) {
+    char *tok = strtok(args, " \t");
+    if (!tok || strcmp(tok, "startpos") != 0) return 0;
+
+    int moves[ROWS * COLS];
+    int heights[COLS] = {0};
+    int n = 0;
+    tok = strtok(NULL, " \t");
+    if (tok && strcmp(tok, "moves") == 0) {
+        while ((tok = strtok(NULL, " \t")) != NULL) {
+            const char *q = tok;
+            while (*q) {
+                int col = *q - '1';
+                if (col < 0 || col >= COLS || heights[col] >= ROWS) return 0;
+                moves[n++] = col;
+                heights[col]++;
+                q++;
+            }
+        }
+    } else if (tok) {
+        return 0;
+    }
+
+    memcpy(ps->moves, moves, n * sizeof(int));
+    ps->n_moves = n;
+    protocol_setup_board(ps);
+    return 1;
+}
+
+static void protocol_go(ProtocolState *ps, char *args) {
+    if (ps->searching && __atomic_load_n(&ps->search_done, __ATOMIC_ACQUIRE)) {
+        pthread_join(ps->waiter, NULL);
+        ps->searching = 0;
+        trace_flush();
+    }
+    if (ps->searching) {
+        protocol_send("info string search already running");
+        return;
+    }
+    double movetime = g_hard_time_limit_ms;
+    int depth = 0;
+    unsigned long long nodes = 0;
+    int limited = 0;
+    int infinite = 0;
+
+    char *tok = strtok(args, " \t");
+    while (tok) {
+        char *val = NULL;
+        if (strcmp(tok, "infinite") == 0) {
+            infinite = 1;
+            limited = 1;
+        } else if ((val = strtok(NULL, " \t")) == NULL) {
+            break;
+        } else if (strcmp(tok, "movetime") == 0) {
+            movetime = atof(val);
+            limited = 2;
+        } else if (strcmp(tok, "depth") == 0) {
+            depth = atoi(val);
+            if (limited < 2) limited = 1;
+        } else if (strcmp(tok, "nodes") == 0) {
+            nodes = strtoull(val, NULL, 10);
+            if (limited < 2) limited = 1;
+        }
+        tok = strtok(NULL, " \t");
+    }
+    /* depth, nodes and infinite search without a clock unless movetime is given. */
+    if (limited == 1) movetime = 0.0;
+
+    if (ps->game_over) {
+        protocol_send("bestmove none");
+        return;
+    }
+
+    learn_add_line(ps->moves, ps->n_moves, 0, 0);
+    g_depth_limit = depth;
+    g_node_limit = nodes;
+    g_infinite = infinite;
+    ps->search_done = 0;
+    ps->infinite = infinite;
+    ps->stopped = 0;
+    if (!search_start(&ps->search, movetime, protocol_progress, NULL)) {
+        protocol_send("info string could not start search");
+        protocol_send("bestmove none");
+        return;
+    }
+    if (pthread_create(&ps->waiter, NULL, protocol_waiter, ps) != 0) {
+        search_stop(&ps->search);
+        search_wait(&ps->search, NULL);
+        protocol_send("bestmove none");
+        return;
+    }
+    ps->searching = 1;
+}
+
+static void protocol_setoption(char *args) {
+    char name[64] = "", value[64] = "";
+    char *tok = strtok(args, " \t");
+    int in_value = 0;
+    while (tok) {
+        if (strcmp(tok, "name") == 0) in_value = 0;
+        else if (strcmp(tok, "value") == 0) in_value = 1;
+        else if (!in_value) snprintf(name, sizeof(name), "%s", tok);
+        else snprintf(value, sizeof(value), "%s", tok);
+        tok = strtok(NULL, " \t");
+    }
+
+    if (strcmp(name, "Hash") == 0) {
+        long mb = atol(value);
+        if (mb < 1 || mb > PROTOCOL_HASH_MAX_MB) {
+            protocol_send("info string Hash must be 1-%d", PROTOCOL_HASH_MAX_MB);
+            return;
+        }
+        if (!tt_resize_mb((size_t)mb)) protocol_send("info string Hash allocation failed");
+    } else if (strcmp(name, "SharedHash") == 0) {
+        size_t mb = g_tt_entries * sizeof(TTSlot) / (1024 * 1024);
+        if (value[0] == '\0' || strcmp(value, "<empty>") == 0) {
+            if (g_tt_shared) tt_resize_mb(mb);
+        } else if (!tt_attach_shared(value, mb)) {
+            protocol_send("info string could not attach shared table %s", value);
+        }
+    } else if (strcmp(name, "Selective") == 0) {
+        g_selective_enabled = (strcmp(value, "true") == 0);
+    } else {
+        protocol_send("info string unknown option %s", name);
+    }
+}
+
+static void protocol_print_board() {
+    pthread_mutex_lock(&g_protocol_out_lock);
+    int r = ROWS - 1;
+    while (r >= 0) {
+        int c = 0;
+        while (c < COLS) {
+            putchar(board[r][c] == 'B' ? 'x' : board[r][c] == 'A' ? 'o' : '.');
+            c++;
+        }
+        putchar('\n');
+        r--;
+    }
+    printf("x to move\n");
+    fflush(stdout);
+    pthread_mutex_unlock(&g_protocol_out_lock);
+}
+
+int run_protocol() {
+    ProtocolState ps;
+    memset(&ps, 0, sizeof(ps));
+    pthread_mutex_init(&ps.lock, NULL);
+    pthread_cond_init(&ps.cond, NULL);
+    protocol_setup_board(&ps);
+
+    char line[PROTOCOL_LINE_MAX];
+    while (fgets(line, sizeof(line), stdin)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *args = line;
+        while (*args == ' ' || *args == '\t') args++;
+        char *cmd = args;
+        while (*args && *args != ' ' && *args != '\t') args++;
+        if (*args) *args++ = '\0';
+
+        if (strcmp(cmd, "c4i") == 0) {
+            protocol_send("id name connect4");
+            protocol_send("option name Hash type spin default %zu min 1 max %d",
+                          g_tt_entries * sizeof(TTSlot) / (1024 * 1024), PROTOCOL_HASH_MAX_MB);
+            protocol_send("option name SharedHash type string default <empty>");
+            protocol_send("option name Selective type check default %s",
+                          g_selective_enabled ? "true" : "false");
+            protocol_send("c4iok");
+        } else if (strcmp(cmd, "isready") == 0) {
+            if (!ps.searching) init_transposition_table();
+            protocol_send("readyok");
+        } else if (strcmp(cmd, "setoption") == 0) {
+            protocol_finish_search(&ps);
+            learn_pause();
+            protocol_setoption(args);
+            learn_resume();
+        } else if (strcmp(cmd, "newgame") == 0) {
+            protocol_finish_search(&ps);
+            ps.n_moves = 0;
+            protocol_setup_board(&ps);
+        } else if (strcmp(cmd, "position") == 0) {
+            protocol_finish_search(&ps);
+            if (!protocol_parse_position(&ps, args)) protocol_send("info string invalid position");
+        } else if (strcmp(cmd, "go") == 0) {
+            protocol_go(&ps, args);
+        } else if (strcmp(cmd, "stop") == 0) {
+            protocol_finish_search(&ps);
+        } else if (strcmp(cmd, "d") == 0) {
+            protocol_print_board();
+        } else if (strcmp(cmd, "quit") == 0) {
+            break;
+        } else if (*cmd) {
+            protocol_send("info string unknown command %s", cmd);
+        }
+    }
+    protocol_finish_search(&ps);
+    pthread_cond_destroy(&ps.cond);
+    pthread_mutex_destroy(&ps.lock);
+    return 0;
+}
+
+
+
+/* Solver comparison (--solve): proves the position after the given moves
+   with df-pn and then with exact alpha-beta from a cleared table, each
+   within the same node limit. */
+#define SOLVE_DEFAULT_NODES 100000000ULL
+
+static const char* solve_result_name(int result) {
+    if (result == DFPN_WIN) return "win";
+    if (result == DFPN_DRAW) return "draw";
+    if (result == DFPN_LOSS) return "loss";
+    return "unknown";
+}
+
+int run_solve(const char *moves, unsigned long long node_limit) {
+    int line[ROWS * COLS];
+    int heights[COLS] = {0};
+    int n = 0;
+    const char *q = moves;
+    while (*q) {
+        int col = *q - '1';
+        if (col < 0 || col >= COLS || heights[col] >= ROWS) {
+            fprintf(stderr, "Invalid move sequence: %s\n", moves);
+            return 1;
+        }
+        line[n++] = col;
+        heights[col]++;
+        q++;
+    }
+    if (setup_position(line, n)) {
+        fprintf(stderr, "Position is already decided.\n");
+        return 1;
+    }
+    init_transposition_table();
+    if (!init_eval_cache(g_eval_cache_bits)) return 1;
+
+    uint64_t cur, mask;
+    bb_from_board('B', &cur, &mask);
+    g_move_start_ms = now_ms();
+    g_time_limit_ms = 0.0;
+    int col = -1;
+    unsigned long long nodes = 0;
+    double t0 = now_ms();
+    int result = dfpn_solve(cur, mask, node_limit, &col, &nodes);
+    double t1 = now_ms();
+    printf("df-pn:      %-7s column %c  nodes %llu  time %.3f s\n",
+           solve_result_name(result), col >= 0 ? '1' + col : '-', nodes, (t1 - t0) / 1000.0);
+
+    tt_initialized = 0;
+    init_transposition_table();
+    clear_eval_cache();
+    int score = 0, depth = 0;
+    col = -1;
+    t0 = now_ms();
+    int solved = alphabeta_solve(node_limit, &col, &score, &depth);
+    t1 = now_ms();
+    result = !solved ? DFPN_UNKNOWN : score > 0 ? DFPN_WIN : score < 0 ? DFPN_LOSS : DFPN_DRAW;
+    printf("alpha-beta: %-7s column %c  nodes %llu  time %.3f s\n",
+           solve_result_name(result), col >= 0 ? '1' + col : '-', g_search_nodes, (t1 - t0) / 1000.0);
+    g_node_limit = 0;
+    clear_board();
+    return 0;
+}
+
+
+
+/* Self-play match (--match): the hard bot with one feature switched on
+   against itself with it off, at a fixed time per move.  The feature is
+   selective search or the evaluation network.  Games start from every
+   two-ply opening, each played once with either engine moving first.
+   Both engines start every move from cleared tables. */
+#define MATCH_HASH_MB 64
+
+#define MATCH_SELECTIVE 0
+#define MATCH_NNUE      1
+
+static const char *g_match_names[2][2] = {
+    {"plain", "selective"},
+    {"handcrafted", "nnue"},
+};
+
+static void match_set_feature(int feature, int on) {
+    if (feature == MATCH_NNUE) nnue_set_enabled(on);
+    else g_selective_enabled = on;
+}
+
+static int match_engine_move(const int *moves, int n, int feature, int on, int *depth) {
+    setup_position(moves, n);
+    match_set_feature(feature, on);
+    tt_initialized = 0;
+    init_transposition_table();
+    clear_eval_cache();
+    __atomic_store_n(&g_stop_requested, 0, __ATOMIC_RELAXED);
+    int col = bot_choose_column_hard();
+    *depth = g_last_search_depth;
+    return col;
+}
+
+int run_selfplay_match(int games, double movetime_ms, int feature) {
+    if (feature == MATCH_NNUE && !g_nnue_loaded) {
+        fprintf(stderr, "match: no evaluation network loaded\n");
+        return 1;
+    }
+    if (!tt_resize_mb(MATCH_HASH_MB) || !init_eval_cache(g_eval_cache_bits)) return 1;
+    double saved_limit = g_hard_time_limit_ms;
+    int saved_selective = g_selective_enabled, saved_nnue = g_nnue_enabled;
+    const char *on_name = g_match_names[feature][1], *off_name = g_match_names[feature][0];
+    g_hard_time_limit_ms = movetime_ms;
+
+    int wins = 0, draws = 0, losses = 0, status = 0;
+    unsigned long long depth_sum[2] = {0, 0}, depth_moves[2] = {0, 0};
+    int g = 0;
+    while (g < games) {
+        int moves[ROWS * COLS];
+        int opening = (g / 2) % (COLS * COLS);
+        moves[0] = opening / COLS;
+        moves[1] = opening % COLS;
+        int n = 2;
+        /* The engine with the feature on moves first in even games. */
+        int on_first = (g % 2 == 0);
+        int result = 0;   /* +1 the feature engine won, -1 lost */
+
+        while (!setup_position(moves, n)) {
+            int on = ((n % 2 == 0) == on_first);
+            int depth = 0;
+            int col = match_engine_move(moves, n, feature, on, &depth);
+            if (col < 0 || col >= COLS || is_column_full(col)) {
+                fprintf(stderr, "match: engine returned an illegal move\n");
+                status = 1;
+                break;
+            }
+            if (depth > 0) {
+                depth_sum[on] += depth;
+                depth_moves[on]++;
+            }
+            int r = drop_piece(col, 'B');
+            moves[n++] = col;
+            if (is_winning_move(r, col, 'B')) {
+                result = on ? 1 : -1;
+                break;
+            }
+        }
+        if (status) break;
+
+        if (result > 0) wins++;
+        else if (result < 0) losses++;
+        else draws++;
+        g++;
+        printf("game %d/%d: %s%s  (%s +%d =%d -%d)\n", g, games,
+               result > 0 ? on_name : result < 0 ? off_name : "draw",
+               result ? " wins" : "", on_name, wins, draws, losses);
+        fflush(stdout);
+    }
+
+    g_hard_time_limit_ms = saved_limit;
+    g_selective_enabled = saved_selective;
+    nnue_set_enabled(saved_nnue);
+    if (status) return status;
+    double score = games ? (wins + 0.5 * draws) / games : 0.0;
+    printf("%s vs %s at %.0f ms/move: +%d =%d -%d  score %.1f%%\n",
+           on_name, off_name, movetime_ms, wins, draws, losses, 100.0 * score);
+    printf("mean completed depth of searched moves: %s %.2f  %s %.2f\n",
+           on_name, depth_moves[1] ? (double)depth_sum[1] / depth_moves[1] : 0.0,
+           off_name, depth_moves[0] ? (double)depth_sum[0] / depth_moves[0] : 0.0);
+    return 0;
+}
+
+
+
+/* Batched game simulator.  Games are kept as column-major bitboards
+   (current player's stones + occupied mask) and advanced in lockstep,
+   four games per AVX2 register, so rollouts never touch board[][]. */
+
+#define SIM_POLICY_EASY   1
+#define SIM_POLICY_MEDIUM 2
+#define SIM_MAX_PLIES     (ROWS * COLS)
+
+typedef struct {
+    int8_t result;   /* +1 first player won, -1 second player won, 0 draw */
+    int8_t plies;
+} SimOutcome;
+
+static inline uint64_t sim_xorshift64(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *s = x;
+    return x;
+}
+
+int sim_choose_move_scalar(uint64_t cur, uint64_t mask, int policy, uint64_t *rng) {
+    int priority[COLS] = {3, 2, 4, 1, 5, 0, 6};
+    int c;
+
+    if (policy == SIM_POLICY_MEDIUM) {
+        uint64_t opp = cur ^ mask;
+        for (c = 0; c < COLS; c++) {
+            if (mask & bb_top_mask_col(c)) continue;
+            uint64_t move = (mask + bb_bottom_mask_col(c)) & bb_column_mask(c);
+            if (bb_has_alignment(cur | move)) return c;
+        }
+        for (c = 0; c < COLS; c++) {
+            if (mask & bb_top_mask_col(c)) continue;
+            uint64_t move = (mask + bb_bottom_mask_col(c)) & bb_column_mask(c);
+            if (bb_has_alignment(opp | move)) return c;
+        }
+        for (c = 0; c < COLS; c++) {
+            if (!(mask & bb_top_mask_col(priority[c]))) return priority[c];
+        }
+        return -1;
+    }
+
+    int valid_cols[COLS];
+    int n = 0;
+    for (c = 0; c < COLS; c++) {
+        if (!(mask & bb_top_mask_col(c))) valid_cols[n++] = c;
+    }
+    if (n == 0) return -1;
+    uint64_t r = sim_xorshift64(rng) >> 32;
+    return valid_cols[(int)((r * (uint64_t)n) >> 32)];
+}
+
+void sim_play_game_scalar(int first_policy, int second_policy, uint64_t *rng, SimOutcome *out) {
+    uint64_t cur = 0, mask = 0;
+    int ply = 0;
+    while (ply < SIM_MAX_PLIES) {
+        int policy = (ply & 1) ? second_policy : first_policy;
+        int col = sim_choose_move_scalar(cur, mask, policy, rng);
+        uint64_t move = (mask + bb_bottom_mask_col(col)) & bb_column_mask(col);
+        if (bb_has_alignment(cur | move)) {
+            out->result = (ply & 1) ? -1 : 1;
+            out->plies = (int8_t)(ply + 1);
+            return;
+        }
+        cur ^= mask;
+        mask |= move;
+        ply++;
+    }
+    out->result = 0;
+    out->plies = SIM_MAX_PLIES;
+}
+
+#if C4_HAVE_AVX2
+
+C4_TARGET_AVX2
+static inline __m256i sim_nonzero4(__m256i x) {
+    return _mm256_xor_si256(_mm256_cmpeq_epi64(x, _mm256_setzero_si256()),
+                            _mm256_set1_epi64x(-1));
+}
+
+C4_TARGET_AVX2
+static inline __m256i sim_alignment4(__m256i p) {
+    __m256i m, hit;
+    m   = _mm256_and_si256(p, _mm256_srli_epi64(p, BB_HEIGHT));
+    hit = _mm256_and_si256(m, _mm256_srli_epi64(m, 2 * BB_HEIGHT));
+    m   = _mm256_and_si256(p, _mm256_srli_epi64(p, BB_HEIGHT - 1));
+    hit = _mm256_or_si256(hit, _mm256_and_si256(m, _mm256_srli_epi64(m, 2 * (BB_HEIGHT - 1))));
+    m   = _mm256_and_si256(p, _mm256_srli_epi64(p, BB_HEIGHT + 1));
+    hit = _mm256_or_si256(hit, _mm256_and_si256(m, _mm256_srli_epi64(m, 2 * (BB_HEIGHT + 1))));
+    m   = _mm256_and_si256(p, _mm256_srli_epi64(p, 1));
+    hit = _mm256_or_si256(hit, _mm256_and_si256(m, _mm256_srli_epi64(m, 2)));
+    return sim_nonzero4(hit);
+}
+
+/* Picks a move bit per lane for the given policy.  Lanes with no legal
+   move get 0. */
+C4_TARGET_AVX2
+static inline __attribute__((always_inline)) __m256i sim_choose_move4(__m256i cur, __m256i mask, int policy, __m256i *rng) {
+    int priority[COLS] = {3, 2, 4, 1, 5, 0, 6};
+    __m256i zero = _mm256_setzero_si256();
+    __m256i moves[COLS], valid[COLS];
+    __m256i chosen = zero;
+    int c;
+
+    for (c = 0; c < COLS; c++) {
+        __m256i top = _mm256_set1_epi64x((long long)bb_top_mask_col(c));
+        valid[c] = _mm256_cmpeq_epi64(_mm256_and_si256(mask, top), zero);
+        moves[c] = _mm256_and_si256(
+            _mm256_and_si256(_mm256_add_epi64(mask, _mm256_set1_epi64x((long long)bb_bottom_mask_col(c))),
+                             _mm256_set1_epi64x((long long)bb_column_mask(c))),
+            valid[c]);
+    }
+
+    if (policy == SIM_POLICY_MEDIUM) {
+        __m256i opp = _mm256_xor_si256(cur, mask);
+        __m256i done = zero;
+        for (c = 0; c < COLS; c++) {
+            __m256i win = _mm256_and_si256(valid[c], sim_alignment4(_mm256_or_si256(cur, moves[c])));
+            __m256i take = _mm256_andnot_si256(done, win);
+            chosen = _mm256_or_si256(chosen, _mm256_and_si256(take, moves[c]));
+            done = _mm256_or_si256(done, take);
+        }
+        for (c = 0; c < COLS; c++) {
+            __m256i block = _mm256_and_si256(valid[c], sim_alignment4(_mm256_or_si256(opp, moves[c])));
+            __m256i take = _mm256_andnot_si256(done, block);
+            chosen = _mm256_or_si256(chosen, _mm256_and_si256(take, moves[c]));
+            done = _mm256_or_si256(done, take);
+        }
+        for (c = 0; c < COLS; c++) {
+            int col = priority[c];
+            __m256i take = _mm256_andnot_si256(done, valid[col]);
+            chosen = _mm256_or_si256(chosen, _mm256_and_si256(take, moves[col]));
+            done = _mm256_or_si256(done, take);
+        }
+        return chosen;
+    }
+
+    /* Uniform pick among legal columns: k = (r * n) >> 32, then take the
+       k-th legal column in index order, as bot_choose_column_easy does. */
+    __m256i x = *rng;
+    x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 13));
+    x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 7));
+    x = _mm256_xor_si256(x, _mm256_slli_epi64(x, 17));
+    *rng = x;
+
+    __m256i n = zero;
+    for (c = 0; c < COLS; c++) n = _mm256_sub_epi64(n, valid[c]);
+    __m256i k = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), n), 32);
+    for (c = 0; c < COLS; c++) {
+        __m256i take = _mm256_and_si256(valid[c], _mm256_cmpeq_epi64(k, zero));
+        chosen = _mm256_or_si256(chosen, _mm256_and_si256(take, moves[c]));
+        k = _mm256_add_epi64(k, valid[c]);
+    }
+    return chosen;
+}
+
+/* Runs n games through four lanes.  A lane that finishes a game records
+   its outcome and immediately starts the next one, so lanes never idle
+   waiting for the longest game in the group. */
+C4_TARGET_AVX2
+static void sim_play_games_avx2(int n, int first_policy, int second_policy, uint64_t *seed, SimOutcome *out) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi64x(1);
+    __m256i full = _mm256_set1_epi64x(SIM_MAX_PLIES);
+    __m256i cur = zero, mask = zero, ply = zero;
+    __m256i rng;
+    long long lane_game[4];
+    int next_game = 0, finished = 0;
+    int lane = 0;
+
+    {
+        uint64_t lanes[4];
+        while (lane < 4) {
+            lanes[lane] = sim_xorshift64(seed) | 1;
+            lane_game[lane] = (next_game < n) ? next_game++ : -1;
+            lane++;
+        }
+        rng = _mm256_loadu_si256((const __m256i*)lanes);
+    }
+    __m256i active = _mm256_set_epi64x(lane_game[3] >= 0 ? -1 : 0, lane_game[2] >= 0 ? -1 : 0,
+                                       lane_game[1] >= 0 ? -1 : 0, lane_game[0] >= 0 ? -1 : 0);
+
+    while (finished < n) {
+        __m256i move;
+        __m256i second = sim_nonzero4(_mm256_and_si256(ply, one));
+        if (first_policy == second_policy) {
+            move = sim_choose_move4(cur, mask, first_policy, &rng);
+        } else {
+            __m256i m1 = sim_choose_move4(cur, mask, first_policy, &rng);
+            __m256i m2 = sim_choose_move4(cur, mask, second_policy, &rng);
+            move = _mm256_blendv_epi8(m1, m2, second);
+        }
+        move = _mm256_and_si256(move, active);
+
+        __m256i won = _mm256_and_si256(active, sim_alignment4(_mm256_or_si256(cur, move)));
+        cur = _mm256_xor_si256(cur, mask);
+        mask = _mm256_or_si256(mask, move);
+        ply = _mm256_sub_epi64(ply, active);
+
+        __m256i ended = _mm256_or_si256(won, _mm256_and_si256(active, _mm256_cmpeq_epi64(ply, full)));
+        int ended_bits = _mm256_movemask_pd(_mm256_castsi256_pd(ended));
+        if (ended_bits) {
+            int won_bits = _mm256_movemask_pd(_mm256_castsi256_pd(won));
+            long long plies[4];
+            _mm256_storeu_si256((__m256i*)plies, ply);
+            long long reset[4] = {0, 0, 0, 0};
+            lane = 0;
+            while (lane < 4) {
+                if (ended_bits & (1 << lane)) {
+                    SimOutcome *o = &out[lane_game[lane]];
+                    o->plies = (int8_t)plies[lane];
+                    if (won_bits & (1 << lane)) o->result = (plies[lane] & 1) ? 1 : -1;
+                    else o->result = 0;
+                    finished++;
+                    lane_game[lane] = (next_game < n) ? next_game++ : -1;
+                    reset[lane] = -1;
+                }
+                lane++;
+            }
+            __m256i r = _mm256_loadu_si256((const __m256i*)reset);
+            cur = _mm256_andnot_si256(r, cur);
+            mask = _mm256_andnot_si256(r, mask);
+            ply = _mm256_andnot_si256(r, ply);
+            active = _mm256_set_epi64x(lane_game[3] >= 0 ? -1 : 0, lane_game[2] >= 0 ? -1 : 0,
+                                       lane_game[1] >= 0 ? -1 : 0, lane_game[0] >= 0 ? -1 : 0);
+        }
+    }
+}
+
+#endif
+
+/* Plays n independent games from the empty board and writes one outcome
+   per game.  Both sides follow the given policies. */
+void simulate_games(int n, int first_policy, int second_policy, uint64_t seed, SimOutcome *out) {
+    uint64_t rng = seed ? seed : 0x9e3779b97f4a7c15ULL;
+    int i = 0;
+
+#if C4_HAVE_AVX2
+    if (cpu_has_avx2()) {
+        sim_play_games_avx2(n, first_policy, second_policy, &rng, out);
+        i = n;
+    }
+#endif
+
+    while (i < n) {
+        sim_play_game_scalar(first_policy, second_policy, &rng, &out[i]);
+        i++;
+    }
+}
+
+int run_simulation_benchmark(int n_games, int first_policy, int second_policy) {
+    SimOutcome *out = (SimOutcome*)malloc(sizeof(SimOutcome) * (size_t)n_games);
+    if (!out) {
+        fprintf(stderr, "Memory allocation failed for simulation.\n");
+        return 1;
+    }
+
+    double t1 = now_ms();
+    simulate_games(n_games, first_policy, second_policy, (uint64_t)time(NULL), out);
+    double t2 = now_ms();
+
+    long first_wins = 0, second_wins = 0, draws = 0, total_plies = 0;
+    int i = 0;
+    while (i < n_games) {
+        if (out[i].result > 0) first_wins++;
+        else if (out[i].result < 0) second_wins++;
+        else draws++;
+        total_plies += out[i].plies;
+        i++;
+    }
+
+    double secs = (t2 - t1) / 1000.0;
+    printf("games: %d (%s)\n", n_games, cpu_has_avx2() ? "avx2" : "scalar");
+    printf("first wins: %ld  second wins: %ld  draws: %ld\n", first_wins, second_wins, draws);
+    printf("avg plies: %.2f\n", n_games > 0 ? (double)total_plies / n_games : 0.0);
+    printf("time: %.3f s  throughput: %.3f Mgames/s\n",
+           secs, secs > 0.0 ? n_games / secs / 1e6 : 0.0);
+    free(out);
+    return 0;
+}
+
+
+
+/* Network training (--nnue-train): writes a weights file for the
+   evaluation network and measures it against evaluate_for_bot().
+   Training positions come from play-outs that block a threat three times
+   in four and otherwise move at random, stopped at a random ply; each is
+   labelled with its df-pn result, and positions df-pn cannot settle
+   within the node budget are dropped.  The network is fitted in floating
+   point to the win probability from the bot's view (cross-entropy,
+   mirrored positions included) and then quantized.  evaluate_for_bot()
+   gets the same logistic fit, and its scale is used for the network's
+   output, so both evaluators speak the same units.  The last tenth of
+   the positions is held out for the comparison. */
+#define NNUE_TRAIN_MIN_PIECES 10
+#define NNUE_TRAIN_MAX_PIECES 34
+#define NNUE_TRAIN_NODES      300000ULL
+#define NNUE_TRAIN_EPOCHS     60
+#define NNUE_TRAIN_RATE       0.05
+#define NNUE_TRAIN_WMAX       2.0f
+#define NNUE_TRAIN_EVAL_CLIP  100000
+
+typedef struct {
+    uint64_t cur;     /* stones of the side to move */
+    uint64_t mask;
+    char     mover;
+    char     first;
+    float    target;  /* 1 bot ('B') wins, 0.5 draw, 0 human wins */
+    int      hand;    /* evaluate_for_bot() */
+} NnueSample;
+
+/* exp() without pulling in libm; plenty for a sigmoid. */
+static double nt_exp(double x) {
+    if (x > 40.0) x = 40.0;
+    if (x < -40.0) x = -40.0;
+    int n = (int)(x * 1.4426950408889634 + (x >= 0.0 ? 0.5 : -0.5));
+    double r = x - n * 0.6931471805599453;
+    double term = 1.0, sum = 1.0;
+    int i = 1;
+    while (i < 14) {
+        term *= r / i;
+        sum += term;
+        i++;
+    }
+    while (n > 0) { sum *= 2.0; n--; }
+    while (n < 0) { sum *= 0.5; n++; }
+    return sum;
+}
+
+static double nt_sigmoid(double x) {
+    return 1.0 / (1.0 + nt_exp(-x));
+}
+
+static void nt_load_board(const NnueSample *p) {
+    char other = (p->mover == 'A') ? 'B' : 'A';
+    int c = 0;
+    while (c < COLS) {
+        int r = 0;
+        while (r < ROWS) {
+            uint64_t bit = 1ULL << (c * BB_HEIGHT + r);
+            board[r][c] = !(p->mask & bit) ? '.' : (p->cur & bit) ? p->mover : other;
+            r++;
+        }
+        c++;
+    }
+    g_first_player = p->first;
+}
+
+/* Network feature indices of the sample, optionally mirrored. */
+static int nt_features(const NnueSample *p, int mirror, int *features) {
+    int n = 0;
+    int c = 0;
+    while (c < COLS) {
+        int r = 0;
+        while (r < ROWS) {
+            uint64_t bit = 1ULL << (c * BB_HEIGHT + r);
+            if (p->mask & bit) {
+                char token = (p->cur & bit) ? p->mover : (p->mover == 'A' ? 'B' : 'A');
+                features[n++] = nnue_feature(r, mirror ? COLS - 1 - c : c, token);
+            }
+            r++;
+        }
+        c++;
+    }
+    return n;
+}
+
+/* A play-out position with the side to move not winning at once. */
+static int nt_random_position(uint64_t *rng, NnueSample *p) {
+    int target = NNUE_TRAIN_MIN_PIECES +
+                 (int)(sim_xorshift64(rng) % (NNUE_TRAIN_MAX_PIECES - NNUE_TRAIN_MIN_PIECES + 1));
+    uint64_t cur = 0, mask = 0;
+    int ply = 0;
+    while (ply < target) {
+        uint64_t playable = (mask + bb_bottom_row()) & bb_board_mask();
+        uint64_t threats = bb_winning_cells(cur ^ mask, mask) & playable;
+        uint64_t move;
+        if (threats && (sim_xorshift64(rng) & 3)) {
+            move = threats & (0ULL - threats);
+        } else {
+            int col = (int)(sim_xorshift64(rng) % COLS);
+            if (mask & bb_top_mask_col(col)) continue;
+            move = (mask + bb_bottom_mask_col(col)) & bb_column_mask(col);
+        }
+        if (bb_has_alignment(cur | move)) return 0;
+        cur ^= mask;
+        mask |= move;
+        ply++;
+    }
+    uint64_t playable = (mask + bb_bottom_row()) & bb_board_mask();
+    if (bb_winning_cells(cur, mask) & playable) return 0;
+
+    p->first = (sim_xorshift64(rng) & 1) ? 'B' : 'A';
+    p->mover = (target % 2 == 0) ? p->first : (p->first == 'A' ? 'B' : 'A');
+    p->cur = cur;
+    p->mask = mask;
+    return 1;
+}
+
+/* The k that makes sigmoid(k * eval) the best cross-entropy fit of the
+   training targets.  The loss is convex in k, so bisect on its slope. */
+static double nt_fit_scale(const NnueSample *s, int n) {
+    double lo = 1e-7, hi = 1e-1;
+    int iter = 0;
+    while (iter < 60) {
+        double k = (lo + hi) / 2.0, slope = 0.0;
+        int i = 0;
+        while (i < n) {
+            slope += (nt_sigmoid(k * s[i].hand) - s[i].target) * s[i].hand;
+            i++;
+        }
+        if (slope > 0.0) hi = k;
+        else lo = k;
+        iter++;
+    }
+    return (lo + hi) / 2.0;
+}
+
+static void nt_report(const char *name, const NnueSample *s, const int *evals, int n, double k) {
+    double brier = 0.0;
+    int decided = 0, right = 0;
+    int i = 0;
+    while (i < n) {
+        double d = nt_sigmoid(k * evals[i]) - s[i].target;
+        brier += d * d;
+        if (s[i].target != 0.5f) {
+            decided++;
+            if ((evals[i] > 0) == (s[i].target > 0.5f) && evals[i] != 0) right++;
+        }
+        i++;
+    }
+    printf("  %-12s Brier score %.4f   sign right on decided positions %5.1f%%\n",
+           name, n ? brier / n : 0.0, decided ? 100.0 * right / decided : 0.0);
+}
+
+int run_nnue_train(int positions, const char *path) {
+    NnueSample *s = (NnueSample*)malloc(sizeof(NnueSample) * (size_t)positions);
+    int *order = (int*)malloc(sizeof(int) * 2 * (size_t)positions);
+    int *evals = (int*)calloc((size_t)positions, sizeof(int));
+    if (!s || !order || !evals) {
+        fprintf(stderr, "Memory allocation failed for training positions.\n");
+        free(s);
+        free(order);
+        free(evals);
+        return 1;
+    }
+
+    /* Label positions. */
+    uint64_t rng = 0x2545f4914f6cdd1dULL;
+    g_time_limit_ms = 0.0;
+    int n = 0, counts[3] = {0, 0, 0};
+    unsigned long long tried = 0;
+    double t0 = now_ms();
+    while (n < positions) {
+        NnueSample *p = &s[n];
+        if (!nt_random_position(&rng, p)) continue;
+        tried++;
+        g_move_start_ms = now_ms();
+        int result = dfpn_solve(p->cur, p->mask, NNUE_TRAIN_NODES, NULL, NULL);
+        if (result == DFPN_UNKNOWN) continue;
+        float mover_score = (result == DFPN_WIN) ? 1.0f : (result == DFPN_DRAW) ? 0.5f : 0.0f;
+        p->target = (p->mover == 'B') ? mover_score : 1.0f - mover_score;
+        nt_load_board(p);
+        int e = evaluate_for_bot_scan();
+        if (e > NNUE_TRAIN_EVAL_CLIP) e = NNUE_TRAIN_EVAL_CLIP;
+        if (e < -NNUE_TRAIN_EVAL_CLIP) e = -NNUE_TRAIN_EVAL_CLIP;
+        p->hand = e;
+        counts[p->target == 1.0f ? 0 : p->target == 0.5f ? 1 : 2]++;
+        n++;
+        if (n % 500 == 0) {
+            fprintf(stderr, "labelled %d/%d positions (%llu tried)\r", n, positions, tried);
+        }
+    }
+    fprintf(stderr, "\n");
+    printf("labelled %d positions in %.1f s (%llu tried): bot wins %d, draws %d, human wins %d\n",
+           n, (now_ms() - t0) / 1000.0, tried, counts[0], counts[1], counts[2]);
+
+    int n_train = n - n / 10;
+    double k = nt_fit_scale(s, n_train);
+
+    /* Fit the float network; mirrored positions are entries n_train.. of
+       the shuffled order. */
+    static float w1[NNUE_INPUTS][NNUE_HIDDEN], b1[NNUE_HIDDEN], w2[NNUE_HIDDEN];
+    float b2 = 0.0f;
+    int f = 0;
+    while (f < NNUE_INPUTS) {
+        int j = 0;
+        while (j < NNUE_HIDDEN) {
+            w1[f][j] = (float)((double)(sim_xorshift64(&rng) >> 11) / (double)(1ULL << 53) - 0.5) * 0.2f;
+            j++;
+        }
+        f++;
+    }
+    int j = 0;
+    while (j < NNUE_HIDDEN) {
+        b1[j] = 0.25f;
+        w2[j] = (float)((double)(sim_xorshift64(&rng) >> 11) / (double)(1ULL << 53) - 0.5) * 0.2f;
+        j++;
+    }
+
+    int total = 2 * n_train;
+    int i = 0;
+    while (i < total) {
+        order[i] = i;
+        i++;
+    }
+    double rate = NNUE_TRAIN_RATE;
+    int epoch = 0;
+    while (epoch < NNUE_TRAIN_EPOCHS) {
+        i = total - 1;
+        while (i > 0) {
+            int r = (int)(sim_xorshift64(&rng) % (uint64_t)(i + 1));
+            int t = order[i];
+            order[i] = order[r];
+            order[r] = t;
+            i--;
+        }
+        i = 0;
+        while (i < total) {
+            const NnueSample *p = &s[order[i] % n_train];
+            int features[ROWS * COLS];
+            int nf = nt_features(p, order[i] >= n_train, features);
+            float pre[NNUE_HIDDEN], h[NNUE_HIDDEN];
+            float y = b2;
+            j = 0;
+            while (j < NNUE_HIDDEN) {
+                float a = b1[j];
+                int q = 0;
+                while (q < nf) {
+                    a += w1[features[q]][j];
+                    q++;
+                }
+                pre[j] = a;
+                h[j] = a < 0.0f ? 0.0f : a > 1.0f ? 1.0f : a;
+                y += w2[j] * h[j];
+                j++;
+            }
+            float g = (float)(nt_sigmoid(y) - p->target) * (float)rate;
+            b2 -= g;
+            j = 0;
+            while (j < NNUE_HIDDEN) {
+                float d = g * w2[j];
+                w2[j] -= g * h[j];
+                if (pre[j] > 0.0f && pre[j] < 1.0f) {
+                    b1[j] -= d;
+                    int q = 0;
+                    while (q < nf) {
+                        float *w = &w1[features[q]][j];
+                        *w -= d;
+                        if (*w > NNUE_TRAIN_WMAX) *w = NNUE_TRAIN_WMAX;
+                        if (*w < -NNUE_TRAIN_WMAX) *w = -NNUE_TRAIN_WMAX;
+                        q++;
+                    }
+                    if (b1[j] > NNUE_TRAIN_WMAX) b1[j] = NNUE_TRAIN_WMAX;
+                    if (b1[j] < -NNUE_TRAIN_WMAX) b1[j] = -NNUE_TRAIN_WMAX;
+                }
+                j++;
+            }
+            i++;
+        }
+        rate *= 0.95;
+        epoch++;
+    }
+
+    /* Quantize: hidden units to [0, NNUE_CLIP], the output to eval units
+       (y / k) with the largest shift that keeps int16 weights and an int32
+       sum. */
+    double max_w2 = 0.0;
+    j = 0;
+    while (j < NNUE_HIDDEN) {
+        double a = w2[j] < 0.0f ? -w2[j] : w2[j];
+        if (a > max_w2) max_w2 = a;
+        j++;
+    }
+    int shift = 16;
+    while (shift > 0) {
+        double scale = (double)(1 << shift) / k;
+        double max_ow = max_w2 * scale / NNUE_CLIP;
+        double ob = (b2 < 0.0f ? -b2 : b2) * scale;
+        if (max_ow <= 32000.0 && NNUE_HIDDEN * NNUE_CLIP * max_ow + ob < 2.0e9) break;
+        shift--;
+    }
+    double scale = (double)(1 << shift) / k;
+    f = 0;
+    while (f < NNUE_INPUTS) {
+        j = 0;
+        while (j < NNUE_HIDDEN) {
+            float v = w1[f][j] * NNUE_CLIP;
+            g_nnue.feature_weights[f][j] = (int16_t)(v < 0.0f ? v - 0.5f : v + 0.5f);
+            j++;
+        }
+        f++;
+    }
+    j = 0;
+    while (j < NNUE_HIDDEN) {
+        float v = b1[j] * NNUE_CLIP;
+        g_nnue.hidden_bias[j] = (int16_t)(v < 0.0f ? v - 0.5f : v + 0.5f);
+        double ow = w2[j] * scale / NNUE_CLIP;
+        g_nnue.output_weights[j] = (int16_t)(ow < 0.0 ? ow - 0.5 : ow + 0.5);
+        j++;
+    }
+    double ob = b2 * scale;
+    g_nnue.output_bias = (int32_t)(ob < 0.0 ? ob - 0.5 : ob + 0.5);
+    g_nnue.output_shift = shift;
+    g_nnue_loaded = 1;
+
+    int status = 0;
+    FILE *out = fopen(path, "wb");
+    if (out) {
+        int32_t header[3] = {NNUE_VERSION, NNUE_INPUTS, NNUE_HIDDEN};
+        size_t ok = 1;
+        ok &= fwrite("C4NN", 1, 4, out) == 4;
+        ok &= fwrite(header, sizeof(int32_t), 3, out) == 3;
+        ok &= fwrite(g_nnue.feature_weights, sizeof(int16_t), NNUE_INPUTS * NNUE_HIDDEN, out) == NNUE_INPUTS * NNUE_HIDDEN;
+        ok &= fwrite(g_nnue.hidden_bias, sizeof(int16_t), NNUE_HIDDEN, out) == NNUE_HIDDEN;
+        ok &= fwrite(g_nnue.output_weights, sizeof(int16_t), NNUE_HIDDEN, out) == NNUE_HIDDEN;
+        ok &= fwrite(&g_nnue.output_bias, sizeof(int32_t), 1, out) == 1;
+        ok &= fwrite(&g_nnue.output_shift, sizeof(int32_t), 1, out) == 1;
+        if (fclose(out) != 0) ok = 0;
+        if (!ok) {
+            fprintf(stderr, "Failed to write network file: %s\n", path);
+            status = 1;
+        }
+    } else {
+        fprintf(stderr, "Could not create network file: %s\n", path);
+        status = 1;
+    }
+    if (!status) printf("wrote %s (output shift %d)\n", path, shift);
+
+    /* Held-out comparison, using the quantized network as the engine runs it. */
+    const NnueSample *test = s + n_train;
+    int n_test = n - n_train;
+    i = 0;
+    while (i < n_test) {
+        evals[i] = test[i].hand;
+        i++;
+    }
+    printf("held-out positions: %d\n", n_test);
+    nt_report("handcrafted", test, evals, n_test, k);
+    i = 0;
+    while (i < n_test) {
+        nt_load_board(&test[i]);
+        nnue_refresh();
+        evals[i] = nnue_evaluate();
+        i++;
+    }
+    nt_report("network", test, evals, n_test, k);
+    clear_board();
+
+    free(s);
+    free(order);
+    free(evals);
+    return status;
+}
+
+
+
+/* Batch position queries.  Positions are passed as structure-of-arrays
+   column-major bitboards: cur[i] holds the stones of the side to move and
+   mask[i] every stone.  Each query fills the parallel result arrays:
+
+     status     BATCH_* below
+     wins       empty cells that would complete a four for the side to move
+     threats    the same cells for the opponent
+     playable   the cell each legal move fills
+     nonlosing  playable moves that win at once or leave the opponent
+                without an immediate win
+
+   All four masks are 0 for terminal positions.  Lanes of four run through
+   AVX2 where available and large batches are split across threads. */
+#define BATCH_ONGOING    0
+#define BATCH_DRAW       1
+#define BATCH_MOVER_WON  2   /* the side that just moved has a four */
+#define BATCH_TOMOVE_WON 3   /* the side to move has a four; not reachable in play */
+
+#define BATCH_MIN_PER_THREAD 65536
+#define BATCH_MAX_THREADS    64
+
+typedef struct {
+    const uint64_t *cur;
+    const uint64_t *mask;
+    int8_t         *status;
+    uint64_t       *wins;
+    uint64_t       *threats;
+    uint64_t       *playable;
+    uint64_t       *nonlosing;
+    int             n;
+} PositionBatch;
+
+static void batch_eval_scalar(const PositionBatch *b, int begin, int end) {
+    uint64_t board_mask = bb_board_mask();
+    uint64_t bottom = bb_bottom_row();
+    int i = begin;
+    while (i < end) {
+        uint64_t cur = b->cur[i], mask = b->mask[i];
+        uint64_t opp = cur ^ mask;
+        int8_t status = BATCH_ONGOING;
+        if (bb_has_alignment(opp)) status = BATCH_MOVER_WON;
+        else if (bb_has_alignment(cur)) status = BATCH_TOMOVE_WON;
+        else if (mask == board_mask) status = BATCH_DRAW;
+
+        uint64_t wins = 0, threats = 0, playable = 0, nonlosing = 0;
+        if (status == BATCH_ONGOING) {
+            wins = bb_winning_cells(cur, mask);
+            threats = bb_winning_cells(opp, mask);
+            playable = (mask + bottom) & board_mask;
+            nonlosing = bb_nonlosing_moves(playable, threats) | (wins & playable);
+        }
+        b->status[i] = status;
+        b->wins[i] = wins;
+        b->threats[i] = threats;
+        b->playable[i] = playable;
+        b->nonlosing[i] = nonlosing;
+        i++;
+    }
+}
+
+#if C4_HAVE_AVX2
+
+C4_TARGET_AVX2
+static inline __attribute__((always_inline)) __m256i batch_winning_cells4(__m256i pos, __m256i empty) {
+    __m256i r = _mm256_and_si256(_mm256_and_si256(_mm256_slli_epi64(pos, 1), _mm256_slli_epi64(pos, 2)),
+                                 _mm256_slli_epi64(pos, 3));
+    int s = BB_HEIGHT - 1;
+    while (s <= BB_HEIGHT + 1) {
+        __m256i p = _mm256_and_si256(_mm256_slli_epi64(pos, s), _mm256_slli_epi64(pos, 2 * s));
+        r = _mm256_or_si256(r, _mm256_and_si256(p, _mm256_slli_epi64(pos, 3 * s)));
+        r = _mm256_or_si256(r, _mm256_and_si256(p, _mm256_srli_epi64(pos, s)));
+        p = _mm256_and_si256(_mm256_srli_epi64(pos, s), _mm256_srli_epi64(pos, 2 * s));
+        r = _mm256_or_si256(r, _mm256_and_si256(p, _mm256_slli_epi64(pos, s)));
+        r = _mm256_or_si256(r, _mm256_and_si256(p, _mm256_srli_epi64(pos, 3 * s)));
+        s++;
+    }
+    return _mm256_and_si256(r, empty);
+}
+
+C4_TARGET_AVX2
+static void batch_eval_avx2(const PositionBatch *b, int begin, int end) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi64x(1);
+    __m256i board_mask = _mm256_set1_epi64x((long long)bb_board_mask());
+    __m256i bottom = _mm256_set1_epi64x((long long)bb_bottom_row());
+    int i = begin;
+    while (i + 4 <= end) {
+        __m256i cur = _mm256_loadu_si256((const __m256i*)(b->cur + i));
+        __m256i mask = _mm256_loadu_si256((const __m256i*)(b->mask + i));
+        __m256i opp = _mm256_xor_si256(cur, mask);
+
+        __m256i mover_won = sim_alignment4(opp);
+        __m256i tomove_won = _mm256_andnot_si256(mover_won, sim_alignment4(cur));
+        __m256i won = _mm256_or_si256(mover_won, tomove_won);
+        __m256i draw = _mm256_andnot_si256(won, _mm256_cmpeq_epi64(mask, board_mask));
+        __m256i live = _mm256_xor_si256(_mm256_or_si256(won, draw), _mm256_set1_epi64x(-1));
+
+        __m256i empty = _mm256_andnot_si256(mask, board_mask);
+        __m256i wins = _mm256_and_si256(live, batch_winning_cells4(cur, empty));
+        __m256i threats = _mm256_and_si256(live, batch_winning_cells4(opp, empty));
+        __m256i playable = _mm256_and_si256(live, _mm256_and_si256(_mm256_add_epi64(mask, bottom), board_mask));
+
+        /* One forced block leaves only that move; two or more lose. */
+        __m256i forced = _mm256_and_si256(playable, threats);
+        __m256i single = _mm256_cmpeq_epi64(_mm256_and_si256(forced, _mm256_sub_epi64(forced, one)), zero);
+        __m256i none = _mm256_cmpeq_epi64(forced, zero);
+        __m256i safe = _mm256_blendv_epi8(_mm256_and_si256(forced, single), playable, none);
+        __m256i nonlosing = _mm256_or_si256(_mm256_andnot_si256(_mm256_srli_epi64(threats, 1), safe),
+                                            _mm256_and_si256(wins, playable));
+
+        _mm256_storeu_si256((__m256i*)(b->wins + i), wins);
+        _mm256_storeu_si256((__m256i*)(b->threats + i), threats);
+        _mm256_storeu_si256((__m256i*)(b->playable + i), playable);
+        _mm256_storeu_si256((__m256i*)(b->nonlosing + i), nonlosing);
+
+        int mover_bits = _mm256_movemask_pd(_mm256_castsi256_pd(mover_won));
+        int tomove_bits = _mm256_movemask_pd(_mm256_castsi256_pd(tomove_won));
+        int draw_bits = _mm256_movemask_pd(_mm256_castsi256_pd(draw));
+        int lane = 0;
+        while (lane < 4) {
+            int bit = 1 << lane;
+            b->status[i + lane] = (mover_bits & bit) ? BATCH_MOVER_WON :
+                                  (tomove_bits & bit) ? BATCH_TOMOVE_WON :
+                                  (draw_bits & bit) ? BATCH_DRAW : BATCH_ONGOING;
+            lane++;
+        }
+        i += 4;
+    }
+    batch_eval_scalar(b, i, end);
+}
+
+#endif
+
+static void batch_eval_range(const PositionBatch *b, int begin, int end) {
+#if C4_HAVE_AVX2
+    if (cpu_has_avx2()) {
+        batch_eval_avx2(b, begin, end);
+        return;
+    }
+#endif
+    batch_eval_scalar(b, begin, end);
+}
+
+typedef struct {
+    const PositionBatch *batch;
+    int begin;
+    int end;
+} BatchTask;
+
+static void* batch_thread_func(void *arg) {
+    BatchTask *t = (BatchTask*)arg;
+    batch_eval_range(t->batch, t->begin, t->end);
+    return NULL;
+}
+
+/* threads <= 0 uses every online CPU.  Each thread gets a contiguous
+   range of at least BATCH_MIN_PER_THREAD positions; the caller's thread
+   takes the first one.  Returns the number of threads used. */
+int position_batch_eval(const PositionBatch *b, int threads) {
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > BATCH_MAX_THREADS) threads = BATCH_MAX_THREADS;
+    if (threads > b->n / BATCH_MIN_PER_THREAD) threads = b->n / BATCH_MIN_PER_THREAD;
+    if (threads < 1) threads = 1;
+
+    pthread_t ids[BATCH_MAX_THREADS];
+    BatchTask tasks[BATCH_MAX_THREADS];
+    int created[BATCH_MAX_THREADS];
+    /* Ranges start on lane boundaries so only the last one has a tail. */
+    int chunk = ((b->n / threads) + 3) & ~3;
+    int t = 0;
+    while (t < threads) {
+        int begin = t * chunk, end = (t + 1) * chunk;
+        if (begin > b->n) begin = b->n;
+        if (end > b->n || t == threads - 1) end = b->n;
+        tasks[t].batch = b;
+        tasks[t].begin = begin;
+        tasks[t].end = end;
+        created[t] = t > 0 && pthread_create(&ids[t], NULL, batch_thread_func, &tasks[t]) == 0;
+        t++;
+    }
+    batch_eval_range(b, tasks[0].begin, tasks[0].end);
+    t = 1;
+    while (t < threads) {
+        if (created[t]) pthread_join(ids[t], NULL);
+        else batch_eval_range(b, tasks[t].begin, tasks[t].end);
+        t++;
+    }
+    return threads;
+}
+
+/* --batch: checks the batch kernels against the per-position board
+   functions and compares their throughput. */
+#define BATCH_BASELINE_MAX  (1 << 18)
+#define BATCH_BENCH_PASSES  3
+
+static void batch_random_positions(uint64_t *cur, uint64_t *mask, int n, uint64_t seed) {
+    uint64_t rng = seed;
+    int i = 0;
+    while (i < n) {
+        uint64_t c = 0, m = 0;
+        int target = (int)(sim_xorshift64(&rng) % (ROWS * COLS + 1));
+        int ply = 0;
+        while (ply < target) {
+            int col = (int)(sim_xorshift64(&rng) % COLS);
+            if (m & bb_top_mask_col(col)) continue;
+            uint64_t move = (m + bb_bottom_mask_col(col)) & bb_column_mask(col);
+            int won = bb_has_alignment(c | move);
+            c ^= m;
+            m |= move;
+            ply++;
+            if (won) break;
+        }
+        cur[i] = c;
+        mask[i] = m;
+        i++;
+    }
+}
+
+static void batch_load_board(uint64_t cur, uint64_t mask) {
+    int c = 0;
+    while (c < COLS) {
+        int r = 0;
+        while (r < ROWS) {
+            uint64_t bit = 1ULL << (c * BB_HEIGHT + r);
+            board[r][c] = !(mask & bit) ? '.' : (cur & bit) ? 'B' : 'A';
+            r++;
+        }
+        c++;
+    }
+}
+
+static int batch_first_col(uint64_t cells) {
+    return cells ? __builtin_ctzll(cells) / BB_HEIGHT : -1;
+}
+
+static long batch_compare(const PositionBatch *a, const PositionBatch *b) {
+    long bad = 0;
+    int i = 0;
+    while (i < a->n) {
+        if (a->status[i] != b->status[i] || a->wins[i] != b->wins[i] || a->threats[i] != b->threats[i] ||
+            a->playable[i] != b->playable[i] || a->nonlosing[i] != b->nonlosing[i]) bad++;
+        i++;
+    }
+    return bad;
+}
+
+static int batch_alloc(PositionBatch *b, int n) {
+    b->n = n;
+    b->status = (int8_t*)malloc((size_t)n);
+    b->wins = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)n);
+    b->threats = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)n);
+    b->playable = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)n);
+    b->nonlosing = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)n);
+    return b->status && b->wins && b->threats && b->playable && b->nonlosing;
+}
+
+static void batch_free(PositionBatch *b) {
+    free(b->status);
+    free(b->wins);
+    free(b->threats);
+    free(b->playable);
+    free(b->nonlosing);
+}
+
+static void batch_report(const char *name, double ms, int n, double base_ns) {
+    double ns = ms * 1e6 / n;
+    printf("%-22s %7.2f ns/pos  %8.2f Mpos/s", name, ns, ns > 0.0 ? 1000.0 / ns : 0.0);
+    if (base_ns > 0.0 && ns > 0.0) printf("  x%.1f", base_ns / ns);
+    printf("\n");
+}
+
+int run_batch_benchmark(int n, int threads) {
+    uint64_t *cur = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)n);
+    uint64_t *mask = (uint64_t*)malloc(sizeof(uint64_t) * (size_t)n);
+    PositionBatch ref, out;
+    memset(&ref, 0, sizeof(ref));
+    memset(&out, 0, sizeof(out));
+    if (!cur || !mask || !batch_alloc(&ref, n) || !batch_alloc(&out, n)) {
+        fprintf(stderr, "Memory allocation failed for position batch.\n");
+        free(cur);
+        free(mask);
+        batch_free(&ref);
+        batch_free(&out);
+        return 1;
+    }
+    batch_random_positions(cur, mask, n, 0x9e3779b97f4a7c15ULL);
+    ref.cur = out.cur = cur;
+    ref.mask = out.mask = mask;
+
+    /* Today's path: one board per position, then game_result_for_bot()
+       and find_winning_move_for() for each side. */
+    int n_base = (n < BATCH_BASELINE_MAX) ? n : BATCH_BASELINE_MAX;
+    char (*boards)[ROWS][COLS] = (char (*)[ROWS][COLS])malloc(sizeof(board) * (size_t)n_base);
+    int *base_result = (int*)malloc(sizeof(int) * 3 * (size_t)n_base);
+    if (!boards || !base_result) {
+        fprintf(stderr, "Memory allocation failed for position batch.\n");
+        free(boards);
+        free(base_result);
+        free(cur);
+        free(mask);
+        batch_free(&ref);
+        batch_free(&out);
+        return 1;
+    }
+    int i = 0;
+    while (i < n_base) {
+        batch_load_board(cur[i], mask[i]);
+        memcpy(boards[i], board, sizeof(board));
+        i++;
+    }
+    double best_base = 0.0;
+    int pass = 0;
+    while (pass < BATCH_BENCH_PASSES) {
+        double t0 = now_ms();
+        i = 0;
+        while (i < n_base) {
+            memcpy(board, boards[i], sizeof(board));
+            int result = game_result_for_bot();
+            base_result[3 * i] = result;
+            base_result[3 * i + 1] = (result == 2) ? find_winning_move_for('B') : -1;
+            base_result[3 * i + 2] = (result == 2) ? find_winning_move_for('A') : -1;
+            i++;
+        }
+        double t = now_ms() - t0;
+        if (pass == 0 || t < best_base) best_base = t;
+        pass++;
+    }
+
+    double best[3] = {0.0, 0.0, 0.0};
+    int used = 1;
+    pass = 0;
+    while (pass < BATCH_BENCH_PASSES) {
+        double t0 = now_ms();
+        batch_eval_scalar(&ref, 0, n);
+        double t1 = now_ms();
+#if C4_HAVE_AVX2
+        if (cpu_has_avx2()) batch_eval_avx2(&out, 0, n);
+#endif
+        double t2 = now_ms();
+        used = position_batch_eval(&out, threads);
+        double t3 = now_ms();
+        if (pass == 0 || t1 - t0 < best[0]) best[0] = t1 - t0;
+        if (pass == 0 || t2 - t1 < best[1]) best[1] = t2 - t1;
+        if (pass == 0 || t3 - t2 < best[2]) best[2] = t3 - t2;
+        pass++;
+    }
+
+    long mismatches = batch_compare(&ref, &out);
+#if C4_HAVE_AVX2
+    if (cpu_has_avx2()) {
+        memset(out.status, -1, (size_t)n);
+        batch_eval_avx2(&out, 0, n);
+        mismatches += batch_compare(&ref, &out);
+    }
+#endif
+    long terminal = 0;
+    i = 0;
+    while (i < n_base) {
+        int status = ref.status[i];
+        int result = base_result[3 * i];
+        int expect = (status == BATCH_MOVER_WON) ? -1 : (status == BATCH_TOMOVE_WON) ? 1 :
+                     (status == BATCH_DRAW) ? 0 : 2;
+        if (result != expect ||
+            base_result[3 * i + 1] != batch_first_col(ref.wins[i] & ref.playable[i]) ||
+            base_result[3 * i + 2] != batch_first_col(ref.threats[i] & ref.playable[i])) mismatches++;
+        i++;
+    }
+    i = 0;
+    while (i < n) {
+        if (ref.status[i] != BATCH_ONGOING) terminal++;
+        i++;
+    }
+
+    double base_ns = best_base * 1e6 / n_base;
+    printf("positions: %d (%ld terminal), %d for per-position calls\n", n, terminal, n_base);
+    batch_report("per-position calls", best_base, n_base, 0.0);
+    batch_report("batch scalar", best[0], n, base_ns);
+    if (cpu_has_avx2()) batch_report("batch avx2", best[1], n, base_ns);
+    char name[32];
+    snprintf(name, sizeof(name), "batch %d thread%s", used, used == 1 ? "" : "s");
+    batch_report(name, best[2], n, base_ns);
+    printf("mismatches: %ld\n", mismatches);
+
+    clear_board();
+    free(boards);
+    free(base_result);
+    free(cur);
+    free(mask);
+    batch_free(&ref);
+    batch_free(&out);
+    return mismatches ? 1 : 0;
+}
+
+
+
+/* Compact game records.  A file is a 16-byte header followed by blocks
+   that are only ever appended:
+
+     block:  uint32 magic 'C4BK', uint32 n_games, uint32 payload_bytes,
+             uint32 reserved, uint32 offsets[n_games], payload
+     game:   uint8 flags, uint8 n_moves, moves packed 3 bits each,
+             then, if GR_FLAG_ANNOTATED, one entry per move:
+             uint8 present, and when present zigzag-varint score,
+             uint8 depth, varint nodes, varint think time in microseconds
+
+   Offsets are relative to the start of the block payload, so a reader
+   can jump to any game once it knows where the blocks start. */
+#define GR_FILE_MAGIC    0x52473443u   /* "C4GR" */
+#define GR_BLOCK_MAGIC   0x4b423443u   /* "C4BK" */
+#define GR_VERSION       1
+#define GR_BLOCK_GAMES   1024
+
+#define GR_FLAG_ANNOTATED   0x01
+#define GR_FLAG_FIRST_B     0x02
+#define GR_RESULT_SHIFT     2
+#define GR_RESULT_DRAW      0
+#define GR_RESULT_FIRST     1
+#define GR_RESULT_SECOND    2
+#define GR_RESULT_UNFINISHED 3
+
+typedef struct {
+    int present;
+    int score;
+    int depth;
+    uint64_t nodes;
+    uint32_t think_us;
+} MoveAnnotation;
+
+typedef struct {
+    char first_player;
+    int  result;
+    int  n_moves;
+    int  annotated;
+    int8_t moves[ROWS * COLS];
+    MoveAnnotation ann[ROWS * COLS];
+} GameRecord;
+
+typedef struct {
+    FILE    *f;
+    uint8_t *buf;
+    size_t   len;
+    size_t   cap;
+    uint32_t offsets[GR_BLOCK_GAMES];
+    int      n_games;
+} GameRecordWriter;
+
+typedef struct {
+    const uint8_t *data;
+    size_t         size;
+    size_t        *block_pos;
+    uint32_t      *block_first;
+    int            n_blocks;
+    long           n_games;
+} GameRecordReader;
+
+void game_record_begin(GameRecord *g, char first_player) {
+    memset(g, 0, sizeof(*g));
+    g->first_player = first_player;
+    g->result = GR_RESULT_UNFINISHED;
+}
+
+void game_record_add_move(GameRecord *g, int col, const MoveAnnotation *ann) {
+    if (g->n_moves >= ROWS * COLS) return;
+    g->moves[g->n_moves] = (int8_t)col;
+    if (ann && ann->present) {
+        g->ann[g->n_moves] = *ann;
+        g->annotated = 1;
+    }
+    g->n_moves++;
+}
+
+static int gr_reserve(GameRecordWriter *w, size_t extra) {
+    if (w->len + extra <= w->cap) return 1;
+    size_t cap = w->cap ? w->cap : 65536;
+    while (cap < w->len + extra) cap *= 2;
+    uint8_t *nb = (uint8_t*)realloc(w->buf, cap);
+    if (!nb) return 0;
+    w->buf = nb;
+    w->cap = cap;
+    return 1;
+}
+
+static void gr_put_varint(GameRecordWriter *w, uint64_t v) {
+    while (v >= 0x80) {
+        w->buf[w->len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    w->buf[w->len++] = (uint8_t)v;
+}
+
+static uint64_t gr_get_varint(const uint8_t **p, const uint8_t *end) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (*p < end && shift < 64) {
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+        shift += 7;
+    }
+    return v;
+}
+
+int game_record_writer_flush(GameRecordWriter *w) {
+    if (!w->f || w->n_games == 0) return 1;
+    uint32_t hdr[4];
+    hdr[0] = GR_BLOCK_MAGIC;
+    hdr[1] = (uint32_t)w->n_games;
+    hdr[2] = (uint32_t)w->len;
+    hdr[3] = 0;
+    int ok = fwrite(hdr, sizeof(hdr), 1, w->f) == 1 &&
+             fwrite(w->offsets, sizeof(uint32_t), (size_t)w->n_games, w->f) == (size_t)w->n_games &&
+             (w->len == 0 || fwrite(w->buf, 1, w->len, w->f) == w->len);
+    fflush(w->f);
+    w->n_games = 0;
+    w->len = 0;
+    if (!ok) fprintf(stderr, "Failed to write game record block.\n");
+    return ok;
+}
+
+int game_record_writer_open(GameRecordWriter *w, const char *filename) {
+    memset(w, 0, sizeof(*w));
+    w->f = fopen(filename, "ab");
+    if (!w->f) {
+        fprintf(stderr, "Could not open game record file: %s\n", filename);
+        return 0;
+    }
+    fseek(w->f, 0, SEEK_END);
+    if (ftell(w->f) == 0) {
+        uint32_t hdr[4] = {GR_FILE_MAGIC, GR_VERSION, 0, 0};
+        fwrite(hdr, sizeof(hdr), 1, w->f);
+    }
+    return 1;
+}
+
+int game_record_writer_append(GameRecordWriter *w, const GameRecord *g) {
+    if (!w->f) return 0;
+    if (!gr_reserve(w, 2 + ROWS * COLS * 24)) return 0;
+
+    w->offsets[w->n_games] = (uint32_t)w->len;
+    uint8_t flags = (uint8_t)((g->result & 3) << GR_RESULT_SHIFT);
+    if (g->annotated) flags |= GR_FLAG_ANNOTATED;
+    if (g->first_player == 'B') flags |= GR_FLAG_FIRST_B;
+    w->buf[w->len++] = flags;
+    w->buf[w->len++] = (uint8_t)g->n_moves;
+
+    size_t packed = ((size_t)g->n_moves * 3 + 7) / 8;
+    memset(w->buf + w->len, 0, packed);
+    int i = 0;
+    while (i < g->n_moves) {
+        int bit = i * 3;
+        uint32_t v = (uint32_t)(g->moves[i] & 7) << (bit & 7);
+        w->buf[w->len + bit / 8] |= (uint8_t)v;
+        if ((bit & 7) > 5) w->buf[w->len + bit / 8 + 1] |= (uint8_t)(v >> 8);
+        i++;
+    }
+    w->len += packed;
+
+    if (g->annotated) {
+        i = 0;
+        while (i < g->n_moves) {
+            const MoveAnnotation *a = &g->ann[i];
+            w->buf[w->len++] = (uint8_t)(a->present ? 1 : 0);
+            if (a->present) {
+                gr_put_varint(w, ((uint64_t)(int64_t)a->score << 1) ^ (uint64_t)((int64_t)a->score >> 63));
+                w->buf[w->len++] = (uint8_t)(a->depth < 0 ? 0 : (a->depth > 255 ? 255 : a->depth));
+                gr_put_varint(w, a->nodes);
+                gr_put_varint(w, a->think_us);
+            }
+            i++;
+        }
+    }
+
+    w->n_games++;
+    if (w->n_games == GR_BLOCK_GAMES) return game_record_writer_flush(w);
+    return 1;
+}
+
+void game_record_writer_close(GameRecordWriter *w) {
+    game_record_writer_flush(w);
+    if (w->f) fclose(w->f);
+    free(w->buf);
+    memset(w, 0, sizeof(*w));
+}
+
+int game_record_reader_open(GameRecordReader *r, const char *filename) {
+    memset(r, 0, sizeof(*r));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open game record file: %s\n", filename);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 16) {
+        fprintf(stderr, "Game record file is too small.\n");
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map game record file.\n");
+        return 0;
+    }
+    r->data = (const uint8_t*)map;
+    r->size = (size_t)st.st_size;
+
+    uint32_t hdr[4];
+    memcpy(hdr, r->data, sizeof(hdr));
+    if (hdr[0] != GR_FILE_MAGIC || hdr[1] != GR_VERSION) {
+        fprintf(stderr, "Game record file has invalid header.\n");
+        munmap(map, r->size);
+        memset(r, 0, sizeof(*r));
+        return 0;
+    }
+
+    /* A block cut short by a crash ends the index; everything before it
+       stays readable. */
+    int cap = 0;
+    size_t pos = 16;
+    while (pos + 16 <= r->size) {
+        uint32_t bh[4];
+        memcpy(bh, r->data + pos, sizeof(bh));
+        size_t block_size = 16 + (size_t)bh[1] * 4 + bh[2];
+        if (bh[0] != GR_BLOCK_MAGIC || pos + block_size > r->size) break;
+        if (r->n_blocks == cap) {
+            cap = cap ? cap * 2 : 64;
+            r->block_pos = (size_t*)realloc(r->block_pos, sizeof(size_t) * (size_t)cap);
+            r->block_first = (uint32_t*)realloc(r->block_first, sizeof(uint32_t) * (size_t)cap);
+            if (!r->block_pos || !r->block_first) {
+                fprintf(stderr, "Memory allocation failed for game record index.\n");
+                return 0;
+            }
+        }
+        r->block_pos[r->n_blocks] = pos;
+        r->block_first[r->n_blocks] = (uint32_t)r->n_games;
+        r->n_blocks++;
+        r->n_games += bh[1];
+        pos += block_size;
+    }
+    return 1;
+}
+
+void game_record_reader_close(GameRecordReader *r) {
+    if (r->data) munmap((void*)r->data, r->size);
+    free(r->block_pos);
+    free(r->block_first);
+    memset(r, 0, sizeof(*r));
+}
+
+int game_record_reader_get(const GameRecordReader *r, long index, GameRecord *g) {
+    if (index < 0 || index >= r->n_games) return 0;
+    int lo = 0, hi = r->n_blocks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (r->block_first[mid] <= (uint32_t)index) lo = mid;
+        else hi = mid - 1;
+    }
+
+    const uint8_t *block = r->data + r->block_pos[lo];
+    uint32_t bh[4];
+    memcpy(bh, block, sizeof(bh));
+    uint32_t off;
+    memcpy(&off, block + 16 + 4 * (index - r->block_first[lo]), sizeof(off));
+    const uint8_t *payload = block + 16 + 4 * (size_t)bh[1];
+    const uint8_t *end = payload + bh[2];
+    const uint8_t *p = payload + off;
+    if (p + 2 > end) return 0;
+
+    uint8_t flags = *p++;
+    memset(g, 0, sizeof(*g));
+    g->first_player = (flags & GR_FLAG_FIRST_B) ? 'B' : 'A';
+    g->result = (flags >> GR_RESULT_SHIFT) & 3;
+    g->annotated = (flags & GR_FLAG_ANNOTATED) != 0;
+    g->n_moves = *p++;
+    if (g->n_moves > ROWS * COLS) return 0;
+
+    size_t packed = ((size_t)g->n_moves * 3 + 7) / 8;
+    if (p + packed > end) return 0;
+    int i = 0;
+    while (i < g->n_moves) {
+        int bit = i * 3;
+        uint32_t v = p[bit / 8];
+        if ((bit & 7) > 5) v |= (uint32_t)p[bit / 8 + 1] << 8;
+        g->moves[i] = (int8_t)((v >> (bit & 7)) & 7);
+        i++;
+    }
+    p += packed;
+
+    if (g->annotated) {
+        i = 0;
+        while (i < g->n_moves && p < end) {
+            MoveAnnotation *a = &g->ann[i];
+            a->present = *p++;
+            if (a->present) {
+                uint64_t z = gr_get_varint(&p, end);
+                a->score = (int)((int64_t)(z >> 1) ^ -(int64_t)(z & 1));
+                a->depth = (p < end) ? *p++ : 0;
+                a->nodes = gr_get_varint(&p, end);
+                a->think_us = (uint32_t)gr_get_varint(&p, end);
+            }
+            i++;
+        }
+    }
+    return 1;
+}
+
+/* Walks a recorded game as bitboards without touching board[][]:
+   after each call, cur/mask describe the position before move `col`,
+   with cur holding the stones of the side about to move. */
+typedef struct {
+    const GameRecord *g;
+    int ply;
+    int col;
+    uint64_t cur;
+    uint64_t mask;
+} GameReplay;
+
+void game_replay_init(GameReplay *it, const GameRecord *g) {
+    it->g = g;
+    it->ply = -1;
+    it->col = -1;
+    it->cur = 0;
+    it->mask = 0;
+}
+
+int game_replay_next(GameReplay *it) {
+    if (it->ply >= 0) {
+        uint64_t move = (it->mask + bb_bottom_mask_col(it->col)) & bb_column_mask(it->col);
+        it->cur ^= it->mask;
+        it->mask |= move;
+    }
+    it->ply++;
+    if (it->ply >= it->g->n_moves) return 0;
+    it->col = it->g->moves[it->ply];
+    if (it->col < 0 || it->col >= COLS || (it->mask & bb_top_mask_col(it->col))) return 0;
+    return 1;
+}
+
+/* Online book learning (--learn).  Positions just past the book edge are
+   counted from recorded and played games; a low-priority thread solves
+   the ones from games the bot lost first, then the ones reached
+   repeatedly, with an exact search.  Solved positions are probed at once
+   from the book's learned entries and merged into the book file every
+   LEARN_MERGE_BATCH solves and on stop.  Positions are kept with
+   'B' to move, the way the bot probes the book. */
+#define LEARN_TABLE_BITS  16
+#define LEARN_MIN_PIECES  13
+#define LEARN_MAX_PIECES  BOOK_PROBE_MAX_PIECES
+#define LEARN_MIN_COUNT   2
+#define LEARN_NODE_BUDGET 50000000ULL
+#define LEARN_MERGE_BATCH 16
+/* How long the interactive mode lets the learner work on a lost game
+   before exiting. */
+#define LEARN_EXIT_WAIT_MS 15000
+
+#define LEARN_PENDING 0
+#define LEARN_SOLVED  1
+#define LEARN_FAILED  2
+
+typedef struct {
+    uint64_t hash;
+    int      count;
+    int      losses;   /* games through here that the bot lost */
+    int8_t   state;
+    int8_t   n_moves;
+    int8_t   moves[LEARN_MAX_PIECES];
+} LearnEntry;
+
+typedef struct {
+    int8_t moves[ROWS * COLS];
+    int    n_moves;
+    int    prefixes;
+    int    lost;
+} LearnLine;
+
+LearnEntry     *g_learn_table = NULL;
+LearnLine      *g_learn_lines = NULL;
+int             g_learn_n_lines = 0;
+int             g_learn_lines_cap = 0;
+pthread_t       g_learn_thread;
+int             g_learn_running = 0;
+int             g_learn_quit = 0;
+int             g_learn_solving = 0;
+/* Nonzero while paused or stopping; the solver's search polls it. */
+int             g_learn_stop = 0;
+/* Set while a lost game's positions may still be unsolved. */
+int             g_learn_lost_pending = 0;
+const char     *g_learn_book_path = NULL;
+const char     *g_learn_records_path = NULL;
+pthread_mutex_t g_learn_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  g_learn_cond = PTHREAD_COND_INITIALIZER;
+
+/* Queues a move list for counting.  With prefixes set every position of
+   the game in range is counted, otherwise only the final one; lost marks
+   a game the bot lost. */
+void learn_add_line(const int *moves, int n, int prefixes, int lost) {
+    if (!g_learn_running || n < LEARN_MIN_PIECES) return;
+    if (n > ROWS * COLS) n = ROWS * COLS;
+    pthread_mutex_lock(&g_learn_lock);
+    if (g_learn_n_lines == g_learn_lines_cap) {
+        int cap = g_learn_lines_cap ? g_learn_lines_cap * 2 : 16;
+        LearnLine *lines = (LearnLine*)realloc(g_learn_lines, sizeof(LearnLine) * (size_t)cap);
+        if (!lines) {
+            pthread_mutex_unlock(&g_learn_lock);
+            return;
+        }
+        g_learn_lines = lines;
+        g_learn_lines_cap = cap;
+    }
+    LearnLine *l = &g_learn_lines[g_learn_n_lines++];
+    int i = 0;
+    while (i < n) {
+        l->moves[i] = (int8_t)moves[i];
+        i++;
+    }
+    l->n_moves = n;
+    l->prefixes = prefixes;
+    l->lost = lost;
+    if (lost) g_learn_lost_pending = 1;
+    pthread_cond_broadcast(&g_learn_cond);
+    pthread_mutex_unlock(&g_learn_lock);
+}
+
+/* Waits for the solver to leave the search; used around anything that
+   reallocates the transposition table. */
+void learn_pause() {
+    pthread_mutex_lock(&g_learn_lock);
+    g_learn_stop++;
+    while (g_learn_solving) pthread_cond_wait(&g_learn_cond, &g_learn_lock);
+    pthread_mutex_unlock(&g_learn_lock);
+}
+
+void learn_resume() {
+    pthread_mutex_lock(&g_learn_lock);
+    g_learn_stop--;
+    pthread_cond_broadcast(&g_learn_cond);
+    pthread_mutex_unlock(&g_learn_lock);
+}
+
+static LearnEntry* learn_slot(uint64_t hash) {
+    size_t mask = ((size_t)1 << LEARN_TABLE_BITS) - 1;
+    size_t i = (size_t)((hash * 0x9e3779b97f4a7c15ULL) >> (64 - LEARN_TABLE_BITS));
+    size_t probes = 0;
+    while (probes <= mask) {
+        LearnEntry *e = &g_learn_table[i];
+        if (e->hash == hash || e->hash == 0) return e;
+        i = (i + 1) & mask;
+        probes++;
+    }
+    return NULL;
+}
+
+/* Whether the bot lost a recorded game.  Only games against the bot
+   carry annotated moves. */
+static int learn_bot_lost(const GameRecord *g) {
+    if (!g->annotated) return 0;
+    if (g->result == GR_RESULT_FIRST) return g->first_player != 'B';
+    if (g->result == GR_RESULT_SECOND) return g->first_player == 'B';
+    return 0;
+}
+
+/* Runs on the solver thread, which owns its board. */
+static void learn_count_line(const int8_t *moves, int n, int prefixes, int lost) {
+    int line[ROWS * COLS];
+    int i = 0;
+    while (i < n) {
+        line[i] = moves[i];
+        i++;
+    }
+    int len = prefixes ? LEARN_MIN_PIECES : n;
+    while (len <= n && len <= LEARN_MAX_PIECES) {
+        if (setup_position(line, len)) break;
+        uint64_t h = hash_board();
+        LearnEntry *e = learn_slot(h);
+        if (!e) break;
+        if (e->hash == 0) {
+            e->hash = h;
+            e->n_moves = (int8_t)len;
+            i = 0;
+            while (i < len) {
+                e->moves[i] = (int8_t)line[i];
+                i++;
+            }
+        }
+        e->count++;
+        e->losses += lost;
+        len++;
+    }
+}
+
+static void learn_seed_records(const char *filename) {
+    GameRecordReader r;
+    if (!game_record_reader_open(&r, filename)) return;
+    GameRecord g;
+    long i = 0;
+    while (i < r.n_games) {
+        if (game_record_reader_get(&r, i, &g)) learn_count_line(g.moves, g.n_moves, 1, learn_bot_lost(&g));
+        i++;
+    }
+    game_record_reader_close(&r);
+}
+
+/* The next unsolved position: one from a lost game if any, since the
+   bot would otherwise repeat the line, then the most frequently reached.
+   Ties go to the one with more pieces since it is cheaper to solve. */
+static LearnEntry* learn_next_candidate() {
+    LearnEntry *best = NULL;
+    size_t i = 0;
+    while (i < ((size_t)1 << LEARN_TABLE_BITS)) {
+        LearnEntry *e = &g_learn_table[i];
+        if (e->hash && e->state == LEARN_PENDING && (e->losses > 0 || e->count >= LEARN_MIN_COUNT)) {
+            if (book_find(e->hash)) {
+                e->state = LEARN_SOLVED;
+            } else if (!best || e->losses > best->losses ||
+                       (e->losses == best->losses && e->count > best->count) ||
+                       (e->losses == best->losses && e->count == best->count &&
+                        e->n_moves > best->n_moves)) {
+                best = e;
+            }
+        }
+        i++;
+    }
+    return best;
+}
+
+/* Solves the position on the board to the end of the game.  Returns 1
+   with a book entry unless the node budget or a pause cut it short. */
+static int learn_solve(const LearnEntry *le, BookEntry *out) {
+    int empty = ROWS * COLS - le->n_moves;
+    int col = -1, score = 0, depth = 0;
+    if (!alphabeta_solve(LEARN_NODE_BUDGET, &col, &score, &depth)) return 0;
+
+    memset(out, 0, sizeof(*out));
+    out->hash = le->hash;
+    out->best_col = (int8_t)col;
+    if (score == 0) {
+        out->outcome = 0;
+        out->depth = (int8_t)empty;
+    } else {
+        int plies = depth - ((score > 0 ? score : -score) - 1000000) + 1;
+        out->outcome = (score > 0) ? 1 : -1;
+        out->depth = (int8_t)(plies < empty ? plies : empty);
+    }
+    return 1;
+}
+
+/* Merges the learned entries not yet in the book, and extra if given,
+   into a copy of the current book, replaces the book file through a
+   rename and publishes the copy. */
+static void learn_merge(const BookEntry *extra) {
+    const BookTable *old = __atomic_load_n(&g_book, __ATOMIC_ACQUIRE);
+    int n = old ? old->size : 0;
+    BookEntry add[BOOK_LEARNED_MAX + 1];
+    int n_add = 0;
+    pthread_mutex_lock(&g_book_lock);
+    int learned = g_book_learned_n;
+    int i = 0;
+    while (i < (1 << BOOK_LEARNED_BITS)) {
+        if (g_book_learned[i].hash && !book_table_find(old, g_book_learned[i].hash))
+            add[n_add++] = g_book_learned[i];
+        i++;
+    }
+    pthread_mutex_unlock(&g_book_lock);
+    if (extra) add[n_add++] = *extra;
+    if (n_add == 0) return;
+    qsort(add, (size_t)n_add, sizeof(BookEntry), book_entry_cmp);
+
+    BookTable *t = (BookTable*)calloc(1, sizeof(BookTable));
+    if (t) t->entries = (BookEntry*)malloc(sizeof(BookEntry) * (size_t)(n + n_add));
+    if (!t || !t->entries) {
+        fprintf(stderr, "Memory allocation failed for learned book.\n");
+        free(t);
+        return;
+    }
+    int a = 0, b = 0;
+    while (a < n || b < n_add) {
+        if (b == n_add || (a < n && old->entries[a].hash < add[b].hash))
+            t->entries[t->size++] = old->entries[a++];
+        else
+            t->entries[t->size++] = add[b++];
+    }
+
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_learn_book_path);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f && fwrite(t->entries, sizeof(BookEntry), (size_t)t->size, f) == (size_t)t->size;
+    if (f && fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, g_learn_book_path) != 0) {
+        fprintf(stderr, "Could not write learned book to %s\n", g_learn_book_path);
+        unlink(tmp);
+    }
+    book_publish(t);
+    pthread_mutex_lock(&g_book_lock);
+    g_book_learned_merged = learned;
+    pthread_mutex_unlock(&g_book_lock);
+}
+
+static void* learn_thread_main(void *arg) {
+    (void)arg;
+#ifdef __linux__
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+    g_stop_flag = &g_learn_stop;
+    g_tt_small = (TTEntry*)malloc(sizeof(TTEntry) * TT_SMALL_SIZE);
+    if (!g_tt_small) {
+        fprintf(stderr, "Memory allocation failed for learner tables.\n");
+        return NULL;
+    }
+    tt_small_clear(g_tt_small);
+    if (g_learn_records_path) learn_seed_records(g_learn_records_path);
+
+    int unmerged = 0;
+    pthread_mutex_lock(&g_learn_lock);
+    while (!g_learn_quit) {
+        if (g_learn_n_lines > 0) {
+            LearnLine l = g_learn_lines[--g_learn_n_lines];
+            pthread_mutex_unlock(&g_learn_lock);
+            learn_count_line(l.moves, l.n_moves, l.prefixes, l.lost);
+            pthread_mutex_lock(&g_learn_lock);
+            continue;
+        }
+        LearnEntry *le = g_learn_stop ? NULL : learn_next_candidate();
+        if (!g_learn_stop && (!le || le->losses == 0) && g_learn_lost_pending) {
+            g_learn_lost_pending = 0;
+            pthread_cond_broadcast(&g_learn_cond);
+        }
+        if (!le) {
+            pthread_cond_wait(&g_learn_cond, &g_learn_lock);
+            continue;
+        }
+        g_learn_solving = 1;
+        pthread_mutex_unlock(&g_learn_lock);
+
+        int moves[LEARN_MAX_PIECES];
+        int i = 0;
+        while (i < le->n_moves) {
+            moves[i] = le->moves[i];
+            i++;
+        }
+        setup_position(moves, le->n_moves);
+        BookEntry e;
+        int solved = learn_solve(le, &e);
+
+        pthread_mutex_lock(&g_learn_lock);
+        g_learn_solving = 0;
+        pthread_cond_broadcast(&g_learn_cond);
+        /* An interrupted solve is retried; one over budget is not. */
+        if (solved) le->state = LEARN_SOLVED;
+        else if (!g_learn_stop) le->state = LEARN_FAILED;
+        if (solved) {
+            pthread_mutex_unlock(&g_learn_lock);
+            if (!book_add_learned(&e)) {
+                learn_merge(&e);
+                unmerged = 0;
+            } else if (++unmerged >= LEARN_MERGE_BATCH) {
+                learn_merge(NULL);
+                unmerged = 0;
+            }
+            pthread_mutex_lock(&g_learn_lock);
+        }
+    }
+    pthread_mutex_unlock(&g_learn_lock);
+    if (unmerged) learn_merge(NULL);
+    free(g_tt_small);
+    g_tt_small = tt_small;
+    return NULL;
+}
+
+/* The transposition table and evaluation cache must already exist. */
+int learn_start(const char *book_path, const char *records_path) {
+    g_learn_table = (LearnEntry*)calloc((size_t)1 << LEARN_TABLE_BITS, sizeof(LearnEntry));
+    if (!g_learn_table) {
+        fprintf(stderr, "Memory allocation failed for learner tables.\n");
+        return 0;
+    }
+    g_learn_book_path = book_path;
+    g_learn_records_path = records_path;
+    g_learn_quit = 0;
+    if (pthread_create(&g_learn_thread, NULL, learn_thread_main, NULL) != 0) {
+        fprintf(stderr, "Could not start book learner.\n");
+        free(g_learn_table);
+        g_learn_table = NULL;
+        return 0;
+    }
+    g_learn_running = 1;
+    return 1;
+}
+
+/* Gives the learner up to timeout_ms to solve the positions of the lost
+   games queued so far. */
+void learn_wait_lost(long timeout_ms) {
+    if (!g_learn_running) return;
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&g_learn_lock);
+    while (g_learn_lost_pending) {
+        if (pthread_cond_timedwait(&g_learn_cond, &g_learn_lock, &until) != 0) break;
+    }
+    pthread_mutex_unlock(&g_learn_lock);
+}
+
+void learn_stop() {
+    if (!g_learn_running) return;
+    pthread_mutex_lock(&g_learn_lock);
+    g_learn_quit = 1;
+    g_learn_stop++;
+    pthread_cond_broadcast(&g_learn_cond);
+    pthread_mutex_unlock(&g_learn_lock);
+    pthread_join(g_learn_thread, NULL);
+    g_learn_running = 0;
+    free(g_learn_table);
+    g_learn_table = NULL;
+    free(g_learn_lines);
+    g_learn_lines = NULL;
+    g_learn_n_lines = g_learn_lines_cap = 0;
+}
+
+
+
+int run_record_dump(const char *filename, long index) {
+    GameRecordReader r;
+    if (!game_record_reader_open(&r, filename)) return 1;
+    printf("games: %ld  blocks: %d\n", r.n_games, r.n_blocks);
+
+    long first = (index >= 0) ? index : 0;
+    long last = (index >= 0) ? index + 1 : r.n_games;
+    double t1 = now_ms();
+    long positions = 0;
+    GameRecord g;
+    long i = first;
+    while (i < last) {
+        if (game_record_reader_get(&r, i, &g)) {
+            GameReplay it;
+            game_replay_init(&it, &g);
+            while (game_replay_next(&it)) positions++;
+            if (index >= 0) {
+                printf("game %ld: first %c, result %d, %d moves\n", i, g.first_player, g.result, g.n_moves);
+                int m = 0;
+                while (m < g.n_moves) {
+                    printf("%2d. col %d", m + 1, g.moves[m] + 1);
+                    if (g.ann[m].present) {
+                        printf("  score %d depth %d nodes %llu time %.3f ms",
+                               g.ann[m].score, g.ann[m].depth,
+                               (unsigned long long)g.ann[m].nodes, g.ann[m].think_us / 1000.0);
+                    }
+                    printf("\n");
+                    m++;
+                }
+            }
+        }
+        i++;
+    }
+    double t2 = now_ms();
+    if (index < 0) {
+        printf("replayed %ld positions in %.3f ms\n", positions, t2 - t1);
+    }
+    game_record_reader_close(&r);
+    return 0;
+}
+
+
+/* Microbenchmarks for the board primitives (--microbench).  Positions come
+   from recorded games, or from seeded random play-outs when there are too
+   few; each primitive runs MB_INNER times per position over several passes
+   and the fastest pass is reported in ns/op.  Results are consumed through
+   empty asm statements so the compiler cannot drop or hoist the calls. */
+#define MB_MAX_POSITIONS 4096
+#define MB_MIN_POSITIONS 256
+#define MB_INNER         64
+#define MB_PASSES        5
+
+typedef struct {
+    char board[ROWS][COLS];
+    char to_move;
+    int  next_col;                   /* a legal move from here */
+    int  last_r, last_c;             /* previous move, last_r -1 at the start */
+    char last_token;
+    unsigned long long hash;
+} BenchPosition;
+
+static inline void mb_use(uint64_t v) {
+    __asm__ __volatile__("" : : "r"(v));
+}
+
+static inline void mb_clobber() {
+    __asm__ __volatile__("" : : : "memory");
+}
+
+/* Adds the positions along one game, stopping before any terminal one. */
+static int mb_add_game(BenchPosition *pos, int n, const int8_t *moves, int n_moves, char first) {
+    clear_board();
+    char token = first;
+    int last_r = -1, last_c = -1;
+    int i = 0;
+    while (i < n_moves && n < MB_MAX_POSITIONS) {
+        int col = moves[i];
+        if (col < 0 || col >= COLS || is_column_full(col)) break;
+        BenchPosition *p = &pos[n++];
+        memcpy(p->board, board, sizeof(board));
+        p->to_move = token;
+        p->next_col = col;
+        p->last_r = last_r;
+        p->last_c = last_c;
+        p->last_token = (token == 'A') ? 'B' : 'A';
+        p->hash = hash_board();
+
+        last_r = drop_piece(col, token);
+        last_c = col;
+        if (is_winning_move(last_r, col, token) || is_draw()) break;
+        token = (token == 'A') ? 'B' : 'A';
+        i++;
+    }
+    return n;
+}
+
+static int mb_load_positions(BenchPosition *pos, const char *records, const char **source) {
+    int n = 0;
+    GameRecordReader r;
+    if (records && access(records, R_OK) == 0 && game_record_reader_open(&r, records)) {
+        GameRecord g;
+        long i = 0;
+        while (i < r.n_games && n < MB_MAX_POSITIONS) {
+            if (game_record_reader_get(&r, i, &g)) n = mb_add_game(pos, n, g.moves, g.n_moves, g.first_player);
+            i++;
+        }
+        game_record_reader_close(&r);
+        *source = "records";
+    }
+    if (n >= MB_MIN_POSITIONS) return n;
+
+    /* Too few recorded positions: top up with play-outs of a greedy
+       player.  Three moves in four it takes a win, or else blocks the
+       opponent's, when there is one; every other move is a random
+       column.  These look more like real games than uniform random
+       moves. */
+    *source = n ? "records+playouts" : "playouts";
+    srand(12345);
+    while (n < MB_MAX_POSITIONS) {
+        int8_t moves[ROWS * COLS];
+        int n_moves = 0;
+        char token = 'A';
+        clear_board();
+        while (n_moves < ROWS * COLS) {
+            int col = (rand() % 4 == 0) ? bot_choose_column_easy() : find_winning_move_for(token);
+            if (col < 0) col = find_winning_move_for(token == 'A' ? 'B' : 'A');
+            if (col < 0 || is_column_full(col)) col = bot_choose_column_easy();
+            if (col < 0) break;
+            int row = drop_piece(col, token);
+            moves[n_moves++] = (int8_t)col;
+            if (is_winning_move(row, col, token) || is_draw()) break;
+            token = (token == 'A') ? 'B' : 'A';
+        }
+        n = mb_add_game(pos, n, moves, n_moves, 'A');
+    }
+    return n;
+}
+
+typedef struct {
+    const char *name;
+    double ns_per_op;
+} BenchResult;
+
+#define MB_PRIM_DROP_UNDO      0
+#define MB_PRIM_DROP_UNDO_INC  1
+#define MB_PRIM_IS_WINNING     2
+#define MB_PRIM_COUNT_DIR      3
+#define MB_PRIM_HASH_BOARD     4
+#define MB_PRIM_FROM_BOARD     5
+#define MB_PRIM_TT_LOOKUP      6
+#define MB_PRIM_TT_STORE       7
+#define MB_PRIM_EVAL_SCAN      8
+#define MB_PRIM_EVAL_INC       9
+#define MB_PRIMS               10
+
+static const char *mb_prim_names[MB_PRIMS] = {
+    "drop_undo", "drop_undo_incremental_eval", "is_winning_move", "count_dir",
+    "hash_board", "from_board", "tt_lookup", "tt_store",
+    "evaluate_for_bot_scan", "evaluate_for_bot_incremental"
+};
+
+/* One pass over all positions; returns elapsed nanoseconds.  With
+   setup_only set it times just the per-position setup, which is
+   subtracted from the result. */
+static double mb_run_pass(int prim, const BenchPosition *pos, int n, int setup_only) {
+    double t0 = now_ms();
+    int i = 0;
+    while (i < n) {
+        const BenchPosition *p = &pos[i];
+        memcpy(board, p->board, sizeof(board));
+        if (prim == MB_PRIM_DROP_UNDO_INC || prim == MB_PRIM_EVAL_INC) eval_inc_refresh();
+        else g_eval_inc_active = 0;
+        int k = 0;
+        switch (setup_only ? -1 : prim) {
+        case MB_PRIM_DROP_UNDO:
+        case MB_PRIM_DROP_UNDO_INC:
+            while (k < MB_INNER) {
+                mb_use((uint64_t)drop_piece(p->next_col, p->to_move));
+                undo_piece(p->next_col);
+                k++;
+            }
+            break;
+        case MB_PRIM_IS_WINNING:
+            if (p->last_r < 0) break;
+            while (k < MB_INNER) {
+                mb_clobber();
+                mb_use((uint64_t)is_winning_move(p->last_r, p->last_c, p->last_token));
+                k++;
+            }
+            break;
+        case MB_PRIM_COUNT_DIR:
+            if (p->last_r < 0) break;
+            while (k < MB_INNER) {
+                mb_clobber();
+                mb_use((uint64_t)count_dir(p->last_r, p->last_c, 0, 1, p->last_token));
+                k++;
+            }
+            break;
+        case MB_PRIM_HASH_BOARD:
+            while (k < MB_INNER) {
+                mb_clobber();
+                mb_use(hash_board());
+                k++;
+            }
+            break;
+        case MB_PRIM_FROM_BOARD:
+            while (k < MB_INNER) {
+                mb_clobber();
+                BitboardState s = from_board();
+                mb_use(s.botBits ^ s.humanBits ^ s.mask);
+                k++;
+            }
+            break;
+        case MB_PRIM_TT_LOOKUP:
+            while (k < MB_INNER) {
+                int move = -1;
+                mb_clobber();
+                mb_use((uint64_t)tt_lookup(p->hash + (uint64_t)k * 0x9e3779b97f4a7c15ULL, 8, -2000000, 2000000, &move));
+                k++;
+            }
+            break;
+        case MB_PRIM_TT_STORE:
+            while (k < MB_INNER) {
+                mb_clobber();
+                tt_store(p->hash + (uint64_t)k * 0x9e3779b97f4a7c15ULL, 8, k, TT_EXACT, p->next_col);
+                k++;
+            }
+            break;
+        case MB_PRIM_EVAL_SCAN:
+            while (k < MB_INNER) {
+                mb_clobber();
+                mb_use((uint64_t)evaluate_for_bot_scan());
+                k++;
+            }
+            break;
+        case MB_PRIM_EVAL_INC:
+            while (k < MB_INNER) {
+                mb_clobber();
+                mb_use((uint64_t)evaluate_for_bot());
+                k++;
+            }
+            break;
+        }
+        i++;
+    }
+    return (now_ms() - t0) * 1e6;
+}
+
+int run_microbench(const char *records, const char *json_path) {
+    BenchPosition *pos = (BenchPosition*)malloc(MB_MAX_POSITIONS * sizeof(BenchPosition));
+    if (!pos) {
+        fprintf(stderr, "Memory allocation failed for microbench positions.\n");
+        return 1;
+    }
+    const char *source = "playouts";
+    int n = mb_load_positions(pos, records, &source);
+    int with_last = 0;
+    int i = 0;
+    while (i < n) {
+        if (pos[i].last_r >= 0) with_last++;
+        i++;
+    }
+
+    init_transposition_table();
+    g_first_player = 'A';
+    /* tt_store refuses to write during an aborted search. */
+    g_time_over = 0;
+
+    BenchResult results[MB_PRIMS];
+    int prim = 0;
+    while (prim < MB_PRIMS) {
+        double best = -1.0, setup = -1.0;
+        mb_run_pass(prim, pos, n, 0);   /* warm-up */
+        int pass = 0;
+        while (pass < MB_PASSES) {
+            double ns = mb_run_pass(prim, pos, n, 0);
+            if (best < 0.0 || ns < best) best = ns;
+            ns = mb_run_pass(prim, pos, n, 1);
+            if (setup < 0.0 || ns < setup) setup = ns;
+            pass++;
+        }
+        best = (best > setup) ? best - setup : 0.0;
+        int ops = (prim == MB_PRIM_IS_WINNING || prim == MB_PRIM_COUNT_DIR) ? with_last : n;
+        results[prim].name = mb_prim_names[prim];
+        results[prim].ns_per_op = ops ? best / ((double)ops * MB_INNER) : 0.0;
+        prim++;
+    }
+    g_eval_inc_active = 0;
+    clear_board();
+    free(pos);
+
+    FILE *out = stdout;
+    if (json_path) {
+        out = fopen(json_path, "w");
+        if (!out) {
+            fprintf(stderr, "Could not open %s for writing.\n", json_path);
+            return 1;
+        }
+    }
+    fprintf(out, "{\n  \"positions\": %d,\n  \"source\": \"%s\",\n  \"inner\": %d,\n  \"passes\": %d,\n  \"results\": {\n",
+            n, source, MB_INNER, MB_PASSES);
+    prim = 0;
+    while (prim < MB_PRIMS) {
+        fprintf(out, "    \"%s\": %.2f%s\n", results[prim].name, results[prim].ns_per_op,
+                prim + 1 < MB_PRIMS ? "," : "");
+        prim++;
+    }
+    fprintf(out, "  }\n}\n");
+    if (json_path) fclose(out);
+    return 0;
+}
+
+
+
+/* Perft: counts every move sequence of exactly N plies from a position,
+   plus the games that end on the way, using only the board primitives
+   the search relies on.  With a position set it counts distinct
+   positions instead, which is checked against OEIS A212693. */
+#define PERFT_MAX_THREADS 64
+#define PERFT_SPLIT_PLIES 2
+
+typedef struct {
+    unsigned long long leaves;
+    unsigned long long terminals;
+    unsigned long long nodes;
+} PerftCounts;
+
+typedef struct {
+    uint64_t *keys;
+    uint64_t  mask;
+    int       shift;
+    unsigned long long used;
+    int overflow;
+} PerftSet;
+
+typedef struct {
+    int moves[PERFT_SPLIT_PLIES];
+    int n_moves;
+} PerftTask;
+
+typedef struct {
+    char root[ROWS][COLS];
+    char root_token;
+    int depth;
+    PerftTask *tasks;
+    int n_tasks;
+    int next_task;
+    PerftSet *set;
+    PerftCounts counts[PERFT_MAX_THREADS];
+} PerftJob;
+
+/* Distinct positions after n plies from the empty board (OEIS A212693). */
+static const unsigned long long perft_reference_unique[] = {
+    1ULL, 7ULL, 49ULL, 238ULL, 1120ULL, 4263ULL, 16422ULL, 54859ULL,
+    184275ULL, 558186ULL, 1662623ULL, 4568683ULL, 12236101ULL
+};
+
+/* Move sequences of exactly n plies from the empty board. */
+static const unsigned long long perft_reference_leaves[] = {
+    1ULL, 7ULL, 49ULL, 343ULL, 2401ULL, 16807ULL, 117649ULL, 823536ULL,
+    5673234ULL, 39394572ULL, 268031646ULL, 1844590828ULL
+};
+
+uint64_t perft_position_key() {
+    uint64_t pos, mask;
+    bb_from_board('A', &pos, &mask);
+    return pos + mask + bb_bottom_row();
+}
+
+/* Returns 1 if key was not in the set yet. */
+int perft_set_insert(PerftSet *s, uint64_t key) {
+    uint64_t i = (key * 0x9e3779b97f4a7c15ULL) >> s->shift;
+    unsigned long long probes = 0;
+    while (probes <= s->mask) {
+        uint64_t cur = __atomic_load_n(&s->keys[i], __ATOMIC_RELAXED);
+        if (cur == key) return 0;
+        if (cur == 0) {
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(&s->keys[i], &expected, key, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_fetch_add(&s->used, 1, __ATOMIC_RELAXED);
+                return 1;
+            }
+            if (expected == key) return 0;
+        }
+        i = (i + 1) & s->mask;
+        probes++;
+    }
+    s->overflow = 1;
+    return 0;
+}
+
+void perft_recurse(int depth, char token, PerftSet *set, PerftCounts *out) {
+    out->nodes++;
+    if (depth == 0) {
+        out->leaves++;
+        return;
+    }
+    char next = (token == 'A') ? 'B' : 'A';
+    int col = 0;
+    while (col < COLS) {
+        if (!is_column_full(col)) {
+            int row = drop_piece(col, token);
+            if (!set || perft_set_insert(set, perft_position_key())) {
+                if (is_winning_move(row, col, token) || is_draw()) {
+                    out->terminals++;
+                    out->nodes++;
+                    if (depth == 1) out->leaves++;
+                } else {
+                    perft_recurse(depth - 1, next, set, out);
+                }
+            }
+            undo_piece(col);
+        }
+        col++;
+    }
+}
+
+typedef struct {
+    PerftJob *job;
+    int id;
+} PerftWorkerArg;
+
+void* perft_thread_func(void *arg) {
+    PerftWorkerArg *wa = (PerftWorkerArg*)arg;
+    PerftJob *job = wa->job;
+    PerftCounts *out = &job->counts[wa->id];
+    TRACE_THREAD("perft");
+    memcpy(board, job->root, sizeof(board));
+    if (g_nnue_enabled) nnue_refresh();
+
+    while (1) {
+        int t = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED);
+        if (t >= job->n_tasks) break;
+        PerftTask *task = &job->tasks[t];
+        TRACE_BEGIN("perft_task", t);
+        char token = job->root_token;
+        int i = 0;
+        while (i < task->n_moves) {
+            drop_piece(task->moves[i], token);
+            token = (token == 'A') ? 'B' : 'A';
+            i++;
+        }
+        perft_recurse(job->depth - task->n_moves, token, job->set, out);
+        while (i > 0) {
+            i--;
+            undo_piece(task->moves[i]);
+        }
+        TRACE_END("perft_task", t);
+    }
+    return NULL;
+}
+
+/* Expands the first plies on the calling thread, counting positions and
+   game ends there, and queues the remaining subtrees as tasks. */
+void perft_split(PerftJob *job, int ply, int *moves, char token, PerftCounts *out, int *cap) {
+    out->nodes++;
+    if (ply == PERFT_SPLIT_PLIES || ply == job->depth) {
+        if (ply == job->depth) {
+            out->leaves++;
+            return;
+        }
+        if (job->n_tasks == *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            job->tasks = (PerftTask*)realloc(job->tasks, sizeof(PerftTask) * (size_t)*cap);
+        }
+        PerftTask *t = &job->tasks[job->n_tasks++];
+        memcpy(t->moves, moves, sizeof(int) * (size_t)ply);
+        t->n_moves = ply;
+        /* The worker counts the task root itself. */
+        out->nodes--;
+        return;
+    }
+    char next = (token == 'A') ? 'B' : 'A';
+    int col = 0;
+    while (col < COLS) {
+        if (!is_column_full(col)) {
+            int row = drop_piece(col, token);
+            if (!job->set || perft_set_insert(job->set, perft_position_key())) {
+                moves[ply] = col;
+                if (is_winning_move(row, col, token) || is_draw()) {
+                    out->terminals++;
+                    out->nodes++;
+                    if (ply + 1 == job->depth) out->leaves++;
+                } else {
+                    perft_split(job, ply + 1, moves, next, out, cap);
+                }
+            }
+            undo_piece(col);
+        }
+        col++;
+    }
+}
+
+int run_perft(int depth, int unique, int n_threads, int set_bits, const char *moves) {
+    PerftJob *job = (PerftJob*)calloc(1, sizeof(PerftJob));
+    PerftSet set;
+    if (!job) {
+        fprintf(stderr, "Memory allocation failed for perft.\n");
+        return 1;
+    }
+    if (n_threads < 1) n_threads = 1;
+    if (n_threads > PERFT_MAX_THREADS - 1) n_threads = PERFT_MAX_THREADS - 1;
+
+    clear_board();
+    char token = 'A';
+    int from_start = 1;
+    const char *m = moves;
+    while (m && *m) {
+        int col = *m - '1';
+        int row = drop_piece(col, token);
+        if (row == -1 || is_winning_move(row, col, token)) {
+            fprintf(stderr, "Invalid or game-ending move sequence: %s\n", moves);
+            free(job);
+            return 1;
+        }
+        token = (token == 'A') ? 'B' : 'A';
+        from_start = 0;
+        m++;
+    }
+    if (game_result_for_bot() != 2) {
+        fprintf(stderr, "Start position is already terminal.\n");
+        free(job);
+        return 1;
+    }
+
+    memset(&set, 0, sizeof(set));
+    if (unique) {
+        set.mask = (1ULL << set_bits) - 1;
+        set.shift = 64 - set_bits;
+        set.keys = (uint64_t*)calloc((size_t)set.mask + 1, sizeof(uint64_t));
+        if (!set.keys) {
+            fprintf(stderr, "Memory allocation failed for perft position set.\n");
+            free(job);
+            return 1;
+        }
+        perft_set_insert(&set, perft_position_key());
+        job->set = &set;
+    }
+
+    memcpy(job->root, board, sizeof(board));
+    job->root_token = token;
+    job->depth = depth;
+
+    double t1 = now_ms();
+    int split_moves[PERFT_SPLIT_PLIES];
+    int cap = 0;
+    PerftCounts *main_counts = &job->counts[n_threads];
+    TRACE_BEGIN("perft_split", depth);
+    perft_split(job, 0, split_moves, token, main_counts, &cap);
+    TRACE_END("perft_split", job->n_tasks);
+
+    pthread_t threads[PERFT_MAX_THREADS];
+    PerftWorkerArg args[PERFT_MAX_THREADS];
+    int i = 0;
+    while (i < n_threads) {
+        args[i].job = job;
+        args[i].id = i;
+        pthread_create(&threads[i], NULL, perft_thread_func, &args[i]);
+        i++;
+    }
+    i = 0;
+    while (i < n_threads) {
+        pthread_join(threads[i], NULL);
+        i++;
+    }
+    double t2 = now_ms();
+    trace_flush();
+
+    PerftCounts total = {0, 0, 0};
+    i = 0;
+    while (i <= n_threads) {
+        total.leaves += job->counts[i].leaves;
+        total.terminals += job->counts[i].terminals;
+        total.nodes += job->counts[i].nodes;
+        i++;
+    }
+
+    double secs = (t2 - t1) / 1000.0;
+    printf("perft %d%s: leaves %llu  terminals %llu  nodes %llu\n",
+           depth, unique ? " (unique)" : "", total.leaves, total.terminals, total.nodes);
+    printf("time: %.3f s  threads: %d  %.2f Mnodes/s\n",
+           secs, n_threads, secs > 0.0 ? total.nodes / secs / 1e6 : 0.0);
+
+    int status = 0;
+    if (unique && set.overflow) {
+        fprintf(stderr, "Position set overflowed; rerun with a larger --set-bits.\n");
+        status = 1;
+    }
+    const unsigned long long *ref = unique ? perft_reference_unique : perft_reference_leaves;
+    int n_ref = unique ? (int)(sizeof(perft_reference_unique) / sizeof(perft_reference_unique[0]))
+                       : (int)(sizeof(perft_reference_leaves) / sizeof(perft_reference_leaves[0]));
+    if (from_start && depth < n_ref) {
+        if (total.leaves == ref[depth]) {
+            printf("reference: OK (%llu)\n", ref[depth]);
+        } else {
+            printf("reference: MISMATCH (expected %llu)\n", ref[depth]);
+            status = 1;
+        }
+    }
+
+    free(set.keys);
+    free(job->tasks);
+    free(job);
+    clear_board();
+    return status;
+}
+
+
+
+double now_ms() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec * 1000.0) + (tv.tv_usec / 1000.0);
+}
+
+
+
+void print_search_progress(const SearchProgress *p, void *user) {
+    (void)user;
+    printf("  depth %2d: column %d  score %d  (%.2f s)\n",
+           p->depth, p->best_col + 1, p->score, p->elapsed_ms / 1000.0);
+    fflush(stdout);
+}
+
+int parse_sim_policy(const char *name) {
+    if (strcmp(name, "easy") == 0) return SIM_POLICY_EASY;
+    if (strcmp(name, "medium") == 0) return SIM_POLICY_MEDIUM;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--simulate") == 0) {
+        int n_games = (argc > 2) ? atoi(argv[2]) : 1000000;
+        int first_policy = (argc > 3) ? parse_sim_policy(argv[3]) : SIM_POLICY_EASY;
+        int second_policy = (argc > 4) ? parse_sim_policy(argv[4]) : first_policy;
+        if (n_games <= 0 || !first_policy || !second_policy) {
+            fprintf(stderr, "usage: %s --simulate <games> [easy|medium] [easy|medium]\n", argv[0]);
+            return 1;
+        }
+        return run_simulation_benchmark(n_games, first_policy, second_policy);
+    }
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        int n = (argc > 2) ? atoi(argv[2]) : 4000000;
+        int threads = (argc > 3) ? atoi(argv[3]) : 0;
+        if (n <= 0) {
+            fprintf(stderr, "usage: %s --batch [positions] [threads]\n", argv[0]);
+            return 1;
+        }
+        return run_batch_benchmark(n, threads);
+    }
+    if (argc > 2 && strcmp(argv[1], "--perft") == 0) {
+        int depth = atoi(argv[2]);
+        int unique = 0, threads = 1, set_bits = 24;
+        const char *moves = NULL;
+        int a = 3;
+        while (a < argc) {
+            if (strcmp(argv[a], "--unique") == 0) unique = 1;
+            else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc) threads = atoi(argv[++a]);
+            else if (strcmp(argv[a], "--set-bits") == 0 && a + 1 < argc) set_bits = atoi(argv[++a]);
+            else if (strcmp(argv[a], "--moves") == 0 && a + 1 < argc) moves = argv[++a];
+            else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc) {
+                if (!trace_open(argv[++a])) return 1;
+            }
+            a++;
+        }
+        if (depth < 0 || depth > ROWS * COLS || set_bits < 10 || set_bits > 34) {
+            fprintf(stderr, "usage: %s --perft <depth> [--unique] [--threads N] [--set-bits B] [--moves 4453] [--trace file]\n", argv[0]);
+            return 1;
+        }
+        int status = run_perft(depth, unique, threads, set_bits, moves);
+        trace_close();
+        return status;
+    }
+    if (argc > 1 && strcmp(argv[1], "--microbench") == 0) {
+        const char *records = "c4_games.rec", *json = NULL;
+        int a = 2;
+        while (a < argc) {
+            if (strcmp(argv[a], "--json") == 0 && a + 1 < argc) json = argv[++a];
+            else records = argv[a];
+            a++;
+        }
+        return run_microbench(records, json);
+    }
+    if (argc > 2 && strcmp(argv[1], "--records") == 0) {
+        return run_record_dump(argv[2], (argc > 3) ? atol(argv[3]) : -1);
+    }
+    if (argc > 2 && strcmp(argv[1], "--solve") == 0) {
+        unsigned long long nodes = (argc > 3) ? strtoull(argv[3], NULL, 10) : SOLVE_DEFAULT_NODES;
+        return run_solve(argv[2], nodes);
+    }
+    if (argc > 2 && strcmp(argv[1], "--nnue-train") == 0) {
+        int positions = atoi(argv[2]);
+        if (positions < 100) {
+            fprintf(stderr, "usage: %s --nnue-train <positions, at least 100> [file]\n", argv[0]);
+            return 1;
+        }
+        return run_nnue_train(positions, (argc > 3) ? argv[3] : "c4_nnue.dat");
+    }
+    if (argc > 2 && strcmp(argv[1], "--match") == 0) {
+        int games = atoi(argv[2]);
+        double movetime = (argc > 3) ? atof(argv[3]) : 200.0;
+        int feature = (argc > 4 && strcmp(argv[4], "nnue") == 0) ? MATCH_NNUE : MATCH_SELECTIVE;
+        if (games <= 0 || movetime <= 0.0 ||
+            (argc > 4 && feature == MATCH_SELECTIVE && strcmp(argv[4], "selective") != 0)) {
+            fprintf(stderr, "usage: %s --match <games> [ms per move] [selective|nnue]\n", argv[0]);
+            return 1;
+        }
+        if (feature == MATCH_NNUE) load_nnue_network("c4_nnue.dat");
+        return run_selfplay_match(games, movetime, feature);
+    }
+    if (argc > 1 && strcmp(argv[1], "--protocol") == 0) {
+        int learn = 0;
+        int a = 2;
+        while (a < argc) {
+            if (strcmp(argv[a], "--learn") == 0) learn = 1;
+            else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc) {
+                if (!trace_open(argv[++a])) return 1;
+            }
+            a++;
+        }
+        load_opening_book("c4_book_12ply.dat");
+        if (load_nnue_network("c4_nnue.dat")) nnue_set_enabled(1);
+        if (learn) {
+            init_transposition_table();
+            if (!init_eval_cache(g_eval_cache_bits)) return 1;
+            learn_start("c4_book_12ply.dat", "c4_games.rec");
+        }
+        int status = run_protocol();
+        learn_stop();
+        trace_close();
+        return status;
+    }
+
+    int show_stats = 0, learn = 0;
+    int a = 1;
+    while (a < argc) {
+        if (strcmp(argv[a], "--stats") == 0) show_stats = 1;
+        else if (strcmp(argv[a], "--learn") == 0) learn = 1;
+        else if (strcmp(argv[a], "--perf") == 0) g_perf_enabled = 1;
+        else if (strcmp(argv[a], "--selective") == 0) g_selective_enabled = 1;
+        else if (strcmp(argv[a], "--metrics") == 0 && a + 1 < argc) g_metrics_path = argv[++a];
+        else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc) {
+            if (!trace_open(argv[++a])) return 1;
+        }
+        else if (strcmp(argv[a], "--shared-tt") == 0 && a + 1 < argc) {
+            if (!tt_attach_shared(argv[++a], g_tt_entries * sizeof(TTSlot) / (1024 * 1024))) return 1;
+        }
+        else if (strcmp(argv[a], "--metrics-interval") == 0 && a + 1 < argc) {
+            g_metrics_interval_ms = atof(argv[++a]) * 1000.0;
+        }
+        a++;
+    }
+    metrics_start();
+
+    clear_board();
+    srand((unsigned)time(NULL));
+
+    
+    
+    load_opening_book("c4_book_12ply.dat");
+    if (load_nnue_network("c4_nnue.dat")) nnue_set_enabled(1);
+    if (learn) {
+        init_transposition_table();
+        if (!init_eval_cache(g_eval_cache_bits)) return 1;
+        learn_start("c4_book_12ply.dat", "c4_games.rec");
+    }
+
+    int mode, difficulty = 2, starter = 1;
+    printf(CYAN BOLD "\nSelect mode:\n" RESET);
+    printf("1. Player vs Player\n");
+    printf("2. Player vs Bot\n> ");
+    scanf("%d", &mode);
+
+    if (mode == 2) {
+        printf(CYAN BOLD "\nSelect bot difficulty:\n" RESET);
+        printf("1. Easy\n2. Medium\n3. Hard\n4. Fixed strength level\n> ");
+        scanf("%d", &difficulty);
+        if (difficulty == 4) {
+            int level = 1;
+            printf(CYAN BOLD "\nSelect level (1-%d):\n" RESET "> ", BOT_LEVEL_COUNT);
+            scanf("%d", &level);
+            difficulty = BOT_LEVEL_BASE + level;
+        }
+
+        printf(CYAN BOLD "\nWho starts first?\n" RESET);
+        printf("1. Player (A)\n2. Bot (B)\n> ");
+        scanf("%d", &starter);
+    }
+
+    char player = (mode == 1 ? 'A' : (starter == 2 ? 'B' : 'A'));
+    int searched = (difficulty == 3 || difficulty > BOT_LEVEL_BASE);
+
+    g_search_progress_fn = print_search_progress;
+
+    GameRecordWriter recorder;
+    GameRecord record;
+    int recording = game_record_writer_open(&recorder, "c4_games.rec");
+    game_record_begin(&record, player);
+
+    while (1) {
+        print_board();
+
+        if (is_draw()) { printf("DRAW!\n"); break; }
+
+        if (mode == 2 && player == 'B') {
+            printf(YELLOW BOLD "\nBot is thinking...\n" RESET);
+
+            double t1 = now_ms();
+            int col = bot_choose_column(difficulty);
+            double t2 = now_ms();
+            book_reclaim();
+            double elapsed = (t2 - t1) / 1000.0;
+
+            printf(RED BOLD "Bot (B) plays column: %d\n" RESET, col + 1);
+            printf(CYAN BOLD "Time taken: %.3f seconds\n\n" RESET, elapsed);
+            if (show_stats && searched) {
+                fprintf(stderr, "nodes %llu  etc cutoffs %llu/%llu  eval cache hits %llu/%llu (%.1f%%)\n",
+                        g_search_nodes, g_etc_cutoffs, g_etc_probes,
+                        g_eval_cache_hits, g_eval_cache_probes,
+                        g_eval_cache_probes ? 100.0 * g_eval_cache_hits / g_eval_cache_probes : 0.0);
+                tt_report_stats(stderr);
+            }
+
+            MoveAnnotation ann;
+            ann.present = 1;
+            ann.score = searched ? g_last_search_score : 0;
+            ann.depth = searched ? g_last_search_depth : 0;
+            ann.nodes = searched ? g_search_nodes : 0;
+            ann.think_us = (uint32_t)((t2 - t1) * 1000.0);
+            game_record_add_move(&record, col, &ann);
+
+            int r = drop_piece(col, 'B');
+            if (is_winning_move(r, col, 'B')) {
+                print_board();
+                printf(RED BOLD "Bot WINS!\n" RESET);
+                record.result = (record.first_player == 'B') ? GR_RESULT_FIRST : GR_RESULT_SECOND;
+                break;
+            }
+        }
+        else {
+            int col;
+            printf(GREEN BOLD "Player %c, choose column (1-7): " RESET, player);
+            scanf("%d", &col);
+            col--;
+
+            int r = drop_piece(col, player);
+            if (r == -1) {
+                printf(RED "Invalid move! Try again.\n" RESET);
+                continue;
+            }
+            game_record_add_move(&record, col, NULL);
+            if (is_winning_move(r, col, player)) {
+                print_board();
+                printf(GREEN BOLD "Player %c WINS!\n" RESET, player);
+                record.result = (record.first_player == player) ? GR_RESULT_FIRST : GR_RESULT_SECOND;
+                break;
+            }
+        }
+
+        if (is_draw()) {
+            print_board();
+            printf("DRAW!\n");
+            record.result = GR_RESULT_DRAW;
+            break;
+        }
+
+        player = (player == 'A') ? 'B' : 'A';
+    }
+
+    if (recording) {
+        game_record_writer_append(&recorder, &record);
+        game_record_writer_close(&recorder);
+    }
+    if (learn && mode == 2) {
+        int line[ROWS * COLS];
+        int i = 0;
+        while (i < record.n_moves) {
+            line[i] = record.moves[i];
+            i++;
+        }
+        int lost = learn_bot_lost(&record);
+        learn_add_line(line, record.n_moves, 1, lost);
+        if (lost) {
+            printf(YELLOW BOLD "Learning from this game...\n" RESET);
+            fflush(stdout);
+            learn_wait_lost(LEARN_EXIT_WAIT_MS);
+        }
+    }
+    learn_stop();
+
+    metrics_stop();
+    trace_close();
+
+    book_free_all();
 
     return 0;
 }